@@ -1,8 +1,44 @@
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
-#define MAX_INPUT 100
+// Number of hash buckets the shuffle splits the mapped records into
+#define NUM_PARTITIONS 8
+// Bytes the input reader asks read(2) for at a time
+#define READ_BLOCK (1 << 20)
+// Slack after the input buffer so 8-byte loads near its end stay in bounds
+#define READ_SLACK 8
+// Times a task of the multi-process runner is started before the job fails
+#define MAX_ATTEMPTS 3
+// A running task is a straggler once it has taken STRAGGLER_FACTOR times as
+// long as the slowest finished task of its phase, and at least
+// STRAGGLER_MIN_SECONDS; it then gets a backup attempt alongside it
+#define STRAGGLER_FACTOR 4
+#define STRAGGLER_MIN_SECONDS 1.0
+// Buffered reduce output is written out once it reaches this many bytes
+#define SINK_FLUSH (1 << 16)
+// Binary groups with at least this many line numbers are written straight
+// from the group with writev instead of being copied into the buffer
+#define SINK_DIRECT_COUNT 4096
+// Most sorted runs merged at once; more runs than this are first merged in
+// passes into longer intermediate runs
+#define MERGE_FAN_IN 128
+// Records the map phase moves through the column layout at a time, small
+// enough that a batch's columns stay in L1
+#define MAP_BATCH 1024
 
 typedef struct {
   int line_number;
@@ -14,63 +50,518 @@ typedef struct {
   int doubled_value;
 } IntermediateInput;
 
+// The same records as columns, for numeric jobs that map whole arrays at
+// once: record i is (line_numbers[i], values[i])
+typedef struct {
+  int count;
+  int *line_numbers;
+  int *values;
+} InputColumns;
+
+typedef struct {
+  int count;
+  int *line_numbers;
+  int *doubled_values;
+} IntermediateColumns;
+
+// Bulk input reader: blocks of stdin are read(2) into buffer and values
+// are parsed straight out of it, either as text lines or, with binary set,
+// as packed little-endian int32s. buffer[end] is always a '\0' sentinel.
+// The buffer has READ_SLACK bytes past capacity for word-at-a-time loads.
+typedef struct {
+  int fd;
+  int binary;
+  int eof;
+  char *buffer;
+  size_t capacity;
+  size_t start; // first unparsed byte
+  size_t end;   // end of the bytes read so far
+} ValueReader;
+
+// One group as seen by reduce: a view into a GroupedOutput
 typedef struct {
   int doubled_value;
-  int line_numbers[MAX_INPUT];
+  int *line_numbers;
   int count;
 } Output;
+
+// All groups in compressed sparse row form: group g has key keys[g] and
+// line numbers line_numbers[offsets[g] .. offsets[g + 1]). Memory is one
+// int per record plus two per group, however the records are distributed.
+typedef struct {
+  int count;
+  int *keys;
+  int *offsets;
+  int *line_numbers;
+} GroupedOutput;
+
+// Open-addressing hash index for one partition: maps a doubled_value to the
+// group that collects it
+typedef struct {
+  int *keys;
+  int *groups; // -1 marks an empty slot
+  uint32_t mask;
+} KeyIndex;
+
+// Grouping strategy: builds the groups of a run of mapped records
+typedef void (*GroupingStrategy)(IntermediateInput *input, int input_size,
+                                 GroupedOutput *grouped);
+
+// Combiner hook: folds one map worker's records for one partition into
+// partial groups before the shuffle, so each key crosses over once per
+// worker instead of once per record
+typedef void (*Combiner)(IntermediateInput *records, int count,
+                         GroupedOutput *partial);
+
+// State of one worker in parallel mode. Worker w maps input[start, end),
+// buckets its records by owning worker, then groups and reduces partition w
+// gathered from every worker's bucket w.
+typedef struct Worker {
+  int id;
+  int num_workers;
+  Input *input;
+  int start;
+  int end;
+  IntermediateInput *mapped; // end - start records, bucketed by partition
+  int *bucket_start;         // num_workers + 1 offsets into mapped
+  Combiner combiner;         // NULL to shuffle raw records
+  GroupedOutput *partials;   // with a combiner: one per partition
+  long shuffled;             // records or partial groups sent to owners
+  struct Worker *workers;
+  pthread_barrier_t *barrier;
+} Worker;
+
+// Where reduce writes: formatted groups collect in buffer and go out with
+// one write(2)/writev(2) per SINK_FLUSH bytes, always as whole groups.
+// Sinks on stdout are shared, so their flushes take stdout_lock; shard
+// sinks own their file.
+typedef struct {
+  int fd;
+  int shared;
+  char *buffer;
+  size_t len;
+  size_t capacity;
+} OutputSink;
+
+// A multi-process job. The input is inherited by every forked task; map task
+// w writes its slice, bucketed by reduce task, into shared memory at
+// slice_start[w], with the bucket offsets in bucket_start[w * (n + 1) ...].
+typedef struct {
+  int num_tasks;
+  Input *input;
+  int *slice_start;          // num_tasks + 1 offsets into input
+  IntermediateInput *mapped; // shared with the tasks
+  int *bucket_start;         // shared with the tasks
+} ProcessJob;
+
+// One attempt at a map or reduce task, running as its own process
+typedef struct {
+  pid_t pid;     // 0 when not running
+  int number;    // 1 for the task's first attempt, 2 for the next, ...
+  int shard;     // reduce tasks writing shard files: the task, else -1
+  int output_fd; // piped reduce tasks: read end of the output pipe, else -1
+  char *output;  // reduce output, held back until the attempt succeeds
+  size_t output_len;
+  size_t output_capacity;
+  struct timespec started;
+} Attempt;
+
+// Supervision state of one map or reduce task. A straggling task keeps
+// running and gets a backup attempt next to it; the first one to succeed
+// wins and the other is killed.
+typedef struct {
+  int attempts; // started so far
+  int done;
+  Attempt running[2];
+} Task;
+
+// One sorted run: count records at offset in a spill file. All runs of a
+// pass share that file, so the merge needs two descriptors however many
+// runs there are. While merging, a run reads ahead into buffer.
+typedef struct {
+  off_t offset;    // next record not yet read into buffer
+  long remaining;  // records of the run not yet read into buffer
+  IntermediateInput *buffer;
+  int buffered;     // records in buffer
+  int buffered_max; // records buffer holds
+  int next;         // next record of buffer to become head
+  IntermediateInput head; // next record of the run
+} SpillRun;
+
+// Groups arriving one key at a time, as a sorted stream produces them
+typedef struct {
+  int doubled_value;
+  int *line_numbers;
+  int count;
+  int capacity;
+} GroupStream;
+
+// Output options, set once by main: with binary_output groups are written as
+// little-endian int32 key, count and line numbers; with output_prefix every
+// reducer writes its own shard file <prefix>.<n> instead of stdout
+static int binary_output = 0;
+static const char *output_prefix = NULL;
+// Multi-process reducers: the attempt number, which keeps each attempt's
+// shard in its own file until the winner is renamed to <prefix>.<n>
+static int shard_attempt = 0;
+static pthread_mutex_t stdout_lock = PTHREAD_MUTEX_INITIALIZER;
+// How the sequential, threaded and multi-process runners group records
+static GroupingStrategy group_records = NULL;
+// The sink reduce writes to on this thread
+static __thread OutputSink *current_sink = NULL;
+
 void map(Input *input, IntermediateInput *intermediate_input);
-void groupByKey(IntermediateInput *input, Output *output, int *result_count);
+void mapBatch(const InputColumns *input, IntermediateColumns *output);
+void mapRecords(Input *input, int count, IntermediateInput *mapped);
+void doubleValues(const int *restrict values, int *restrict doubled,
+                  int count);
+void benchMap(void);
+void initReader(ValueReader *reader, int fd, int binary);
+void freeReader(ValueReader *reader);
+int fillReader(ValueReader *reader);
+int readValue(ValueReader *reader, int *value);
+Input *readInput(ValueReader *reader, int *input_size);
+void groupByKey(IntermediateInput *input, int input_size,
+                GroupedOutput *grouped);
+void groupByKeyRadix(IntermediateInput *input, int input_size,
+                     GroupedOutput *grouped);
+void benchGrouping(void);
+Output getGroup(GroupedOutput *grouped, int g);
+void freeGroupedOutput(GroupedOutput *grouped);
 void reduce(Output *output);
+void openSink(OutputSink *sink, int shard);
+void closeSink(OutputSink *sink);
+void reserveSink(OutputSink *sink, size_t bytes);
+void flushSink(OutputSink *sink, const void *extra, size_t extra_len);
+char *formatInt(char *end, int value);
+void putInt32(char *out, int value);
+uint32_t hashKey(int key);
+int partitionOf(int key);
+int partitionFor(int key, int num_partitions);
+void runParallel(Input *input_data, int input_size, int num_workers,
+                 Combiner combiner);
+void combineLineNumbers(IntermediateInput *records, int count,
+                        GroupedOutput *partial);
+void mergePartials(Worker *self, GroupedOutput *grouped);
+void *workerThread(void *arg);
+void mapAndBucket(Input *input, int start, int end, int num_partitions,
+                  IntermediateInput *mapped, int *bucket_start);
+void runProcesses(Input *input_data, int input_size, int num_tasks);
+void runPhase(ProcessJob *job, Task *tasks, int reducing);
+void startTask(ProcessJob *job, Task *task, int id, int reducing);
+void stopAttempt(Attempt *attempt);
+int readOutput(Attempt *attempt);
+void shardPath(char *path, size_t size, int shard, int attempt);
+void mapTask(ProcessJob *job, int w);
+void reduceTask(ProcessJob *job, int r);
+double secondsSince(struct timespec *start);
+void initKeyIndex(KeyIndex *index, int max_keys);
+void freeKeyIndex(KeyIndex *index);
+int findOrAddGroup(KeyIndex *index, int key, int *num_groups);
+void runSpill(ValueReader *reader, long budget_bytes);
+int compareRecords(const void *a, const void *b);
+int createSpillFile(void);
+void writeRecords(int fd, off_t *end, IntermediateInput *records, int count);
+SpillRun spillRun(int fd, off_t *end, IntermediateInput *records, int count);
+int nextFromRun(int fd, SpillRun *run);
+SpillRun mergeRuns(int fd, SpillRun *runs, int num_runs, int buffer_records,
+                   GroupStream *stream, int out_fd, off_t *out_end);
+void streamRecord(GroupStream *stream, IntermediateInput *record);
+void flushStream(GroupStream *stream);
 
-int main() {
-  Input input_data[MAX_INPUT];
+int main(int argc, char *argv[]) {
+  Input *input_data;
   int input_size = 0;
-  int value;
+  int num_workers = 0;
+  int num_processes = 0;
+  long spill_mb = 0;
+  Combiner combiner = NULL;
+  int binary = 0;
+  int bad_args = 0;
+  int bench = 0;
+  int bench_map = 0;
+  ValueReader reader;
 
-  // Read input values until "end" is encountered
-  printf("Enter values (one per line). Type 'end' to finish:\n");
-  while (input_size < MAX_INPUT) {
-    char buffer[100];
-    if (fgets(buffer, sizeof(buffer), stdin) == NULL) {
-      break;
-    }
-    if (sscanf(buffer, "%d", &value) == 1) {
-      input_data[input_size].line_number = input_size + 1;
-      input_data[input_size].value = value;
-      input_size++;
-    } else if (sscanf(buffer, "end") == 0) {
-      break;
+  // -p N runs map, group and reduce on N worker threads, and -c adds the
+  // line-number combiner to it; -m N forks N map and N reduce processes;
+  // -s MB bounds the memory used for mapped records and spills sorted runs
+  // to disk, but takes at most INT_MAX records (16 GB of mapped records),
+  // as line numbers are ints in every output format; -b reads packed
+  // little-endian int32 values instead of text lines, -B writes groups in
+  // binary, and -o PREFIX writes each reducer's groups to its own shard
+  // file; -g picks the grouping strategy, or benchmarks them against each
+  // other; -M benchmarks the map kernels
+  group_records = groupByKey;
+  for (int i = 1; i < argc && !bad_args; i++) {
+    if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      num_workers = atoi(argv[++i]);
+      bad_args = num_workers < 1;
+    } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+      num_processes = atoi(argv[++i]);
+      bad_args = num_processes < 1;
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      spill_mb = atol(argv[++i]);
+      bad_args = spill_mb < 1;
+    } else if (strcmp(argv[i], "-c") == 0) {
+      combiner = combineLineNumbers;
+    } else if (strcmp(argv[i], "-b") == 0) {
+      binary = 1;
+    } else if (strcmp(argv[i], "-B") == 0) {
+      binary_output = 1;
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      output_prefix = argv[++i];
+    } else if (strcmp(argv[i], "-M") == 0) {
+      bench_map = 1;
+    } else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "hash") == 0) {
+        group_records = groupByKey;
+      } else if (strcmp(argv[i], "radix") == 0) {
+        group_records = groupByKeyRadix;
+      } else {
+        bench = strcmp(argv[i], "bench") == 0;
+        bad_args = !bench;
+      }
     } else {
-      printf("Invalid input. Please enter an integer or 'end' to finish.\n");
+      bad_args = 1;
     }
   }
+  if (bad_args ||
+      (num_workers > 0) + (num_processes > 0) + (spill_mb > 0) > 1 ||
+      (combiner != NULL && num_workers == 0)) {
+    fprintf(stderr,
+            "Usage: %s [-b] [-B] [-o shard_prefix] [-g hash|radix|bench] "
+            "[-M] [-p num_workers [-c] | -m num_processes | -s budget_mb]\n",
+            argv[0]);
+    return 1;
+  }
+  if (bench) {
+    benchGrouping();
+    return 0;
+  }
+  if (bench_map) {
+    benchMap();
+    return 0;
+  }
+
+  initReader(&reader, STDIN_FILENO, binary);
+  if (spill_mb > 0) {
+    runSpill(&reader, spill_mb * 1024 * 1024);
+    freeReader(&reader);
+    return 0;
+  }
+
+  input_data = readInput(&reader, &input_size);
+  freeReader(&reader);
+
+  if (num_workers > 0) {
+    runParallel(input_data, input_size, num_workers, combiner);
+    free(input_data);
+    return 0;
+  }
+  if (num_processes > 0) {
+    runProcesses(input_data, input_size, num_processes);
+    free(input_data);
+    return 0;
+  }
 
   // Step 1: Map phase
 
-  IntermediateInput mapped_results[MAX_INPUT] = {0};
-  for (int i = 0; i < input_size; i++) {
-    map(&input_data[i], &mapped_results[i]);
+  IntermediateInput *mapped_results =
+      malloc((input_size + 1) * sizeof(IntermediateInput));
+  if (mapped_results == NULL) {
+    perror("malloc");
+    exit(1);
   }
+  mapRecords(input_data, input_size, mapped_results);
 
   // Step 2: Grouping phase
 
-  Output output_results[MAX_INPUT] = {0};
-  int result_count = 0;
+  GroupedOutput output_results;
 
-  for (int i = 0; i < input_size; i++) {
-    groupByKey(&mapped_results[i], output_results, &result_count);
-  }
+  group_records(mapped_results, input_size, &output_results);
 
   // Step 3: Reduce phase
-  for (int i = 0; i < result_count; i++) {
-    if (output_results[i].count > 0) {
-      reduce(&output_results[i]);
-    }
+  OutputSink sink;
+  openSink(&sink, 0);
+  for (int i = 0; i < output_results.count; i++) {
+    Output group = getGroup(&output_results, i);
+    reduce(&group);
   }
+  closeSink(&sink);
 
+  freeGroupedOutput(&output_results);
+  free(mapped_results);
+  free(input_data);
   return 0;
 }
+void initReader(ValueReader *reader, int fd, int binary) {
+  reader->fd = fd;
+  reader->binary = binary;
+  reader->eof = 0;
+  reader->capacity = READ_BLOCK;
+  reader->buffer = malloc(reader->capacity + READ_SLACK);
+  if (reader->buffer == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  reader->buffer[0] = '\0';
+  reader->start = 0;
+  reader->end = 0;
+}
+void freeReader(ValueReader *reader) {
+  free(reader->buffer);
+  reader->buffer = NULL;
+}
+int fillReader(ValueReader *reader) {
+  // Move the unparsed tail to the front, growing the buffer only when a
+  // single line fills it, and read one more block behind it. Returns 0 once
+  // the input is exhausted.
+  size_t pending = reader->end - reader->start;
+  ssize_t got;
+
+  memmove(reader->buffer, reader->buffer + reader->start, pending);
+  reader->start = 0;
+  reader->end = pending;
+  if (reader->capacity - pending < READ_BLOCK / 2) {
+    reader->capacity *= 2;
+    reader->buffer = realloc(reader->buffer, reader->capacity + READ_SLACK);
+    if (reader->buffer == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  do {
+    got = read(reader->fd, reader->buffer + reader->end,
+               reader->capacity - reader->end);
+  } while (got == -1 && errno == EINTR);
+  if (got == -1) {
+    perror("read");
+    exit(1);
+  }
+  reader->end += got;
+  reader->buffer[reader->end] = '\0';
+  reader->eof = got == 0;
+  return got > 0;
+}
+int readValue(ValueReader *reader, int *value) {
+  // Parse the next value; returns 0 at "end" or end of input
+  if (reader->binary) {
+    while (reader->end - reader->start < 4) {
+      if (!fillReader(reader)) {
+        if (reader->end > reader->start) {
+          fprintf(stderr, "Ignoring %zu trailing bytes of binary input\n",
+                  reader->end - reader->start);
+          reader->start = reader->end;
+        }
+        return 0;
+      }
+    }
+    const unsigned char *bytes =
+        (const unsigned char *)reader->buffer + reader->start;
+    *value = (int)((uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+                   (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24);
+    reader->start += 4;
+    return 1;
+  }
+
+  // Text: parse the number in place, then find the end of its line. The
+  // '\0' sentinel at buffer[end] stops every scan without a bounds check;
+  // a line cut off by the end of the block is parsed again after a refill.
+  for (;;) {
+    const char *p = reader->buffer + reader->start;
+    const char *newline;
+    uint32_t magnitude = 0;
+    unsigned digit;
+    int negative, has_digits;
+
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\v' ||
+           *p == '\f') {
+      p++;
+    }
+    negative = *p == '-';
+    p += *p == '-' || *p == '+';
+    has_digits = (unsigned)(*p - '0') <= 9;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    {
+      // Up to 8 digits at once: flag the bytes that are not '0'..'9', and
+      // fold the digits before the first flagged byte in three multiplies.
+      // Any digits beyond 8 are left to the loop below.
+      uint64_t word, flags;
+      int len;
+      memcpy(&word, p, sizeof(word));
+      word ^= 0x3030303030303030ull;
+      flags = (word | (word + 0x0606060606060606ull)) & 0xf0f0f0f0f0f0f0f0ull;
+      len = flags ? __builtin_ctzll(flags) / 8 : 8;
+      if (len > 0) {
+        word = len < 8 ? word << (64 - 8 * len) : word;
+        word = (word * 10 + (word >> 8)) & 0x00ff00ff00ff00ffull;
+        word = (word * 100 + (word >> 16)) & 0x0000ffff0000ffffull;
+        magnitude = (uint32_t)(word * 10000 + (word >> 32));
+        p += len;
+      }
+    }
+#endif
+    while ((digit = (unsigned)(*p - '0')) <= 9) {
+      magnitude = magnitude * 10 + digit;
+      p++;
+    }
+    // Usually the number ends the line; otherwise memchr skips the rest
+    newline = *p == '\n' ? p
+                         : memchr(p, '\n', reader->buffer + reader->end - p);
+    if (newline == NULL && !reader->eof && fillReader(reader)) {
+      continue;
+    }
+    if (reader->start == reader->end) {
+      return 0;
+    }
+    reader->start = newline ? (size_t)(newline - reader->buffer) + 1
+                            : reader->end;
+    if (!has_digits) {
+      // Not an integer: "end" (or anything else) finishes the input
+      return 0;
+    }
+    *value = (int)(negative ? 0u - magnitude : magnitude);
+    return 1;
+  }
+}
+Input *readInput(ValueReader *reader, int *input_size) {
+  // Read input values until "end" is encountered, doubling the array
+  // whenever it fills up. Line numbers and counts are ints, so at most
+  // INT_MAX values are accepted.
+  size_t capacity = 64;
+  Input *input_data = malloc(capacity * sizeof(Input));
+  int value;
+
+  if (input_data == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+
+  if (!reader->binary && !binary_output) {
+    printf("Enter values (one per line). Type 'end' to finish:\n");
+  }
+  *input_size = 0;
+  while (readValue(reader, &value)) {
+    if (*input_size == INT_MAX) {
+      fprintf(stderr, "Too many input values: at most %d are supported\n",
+              INT_MAX);
+      exit(1);
+    }
+    if ((size_t)*input_size == capacity) {
+      capacity = capacity * 2 < INT_MAX ? capacity * 2 : INT_MAX;
+      input_data = realloc(input_data, capacity * sizeof(Input));
+      if (input_data == NULL) {
+        perror("realloc");
+        exit(1);
+      }
+    }
+    input_data[*input_size].line_number = *input_size + 1;
+    input_data[*input_size].value = value;
+    (*input_size)++;
+  }
+  return input_data;
+}
 void map(Input *input, IntermediateInput *intermediate_input) {
   // Preserve the line number (key)
   intermediate_input->line_number = input->line_number;
@@ -78,46 +569,1390 @@ void map(Input *input, IntermediateInput *intermediate_input) {
   // Double the value of the input
   intermediate_input->doubled_value = input->value * 2;
 }
-void groupByKey(IntermediateInput *input, Output *output, int *result_count) {
-  // Group entries
-  // If the doubled value exists in the output entries, add it to the output's
-  // line_numbers list If it doesn't exist, add a new entry to the output
+void mapBatch(const InputColumns *input, IntermediateColumns *output) {
+  // map() over whole columns: the keys carry over unchanged and the values
+  // are transformed in one tight loop
+  output->count = input->count;
+  memcpy(output->line_numbers, input->line_numbers,
+         input->count * sizeof(int));
+  doubleValues(input->values, output->doubled_values, input->count);
+}
+void mapRecords(Input *input, int count, IntermediateInput *mapped) {
+  // The map phase: records are split into columns a batch at a time, run
+  // through mapBatch(), and zipped back into IntermediateInput records,
+  // the layout grouping works on
+  int line_numbers[MAP_BATCH], values[MAP_BATCH];
+  int mapped_line_numbers[MAP_BATCH], doubled_values[MAP_BATCH];
+  InputColumns columns = {0, line_numbers, values};
+  IntermediateColumns mapped_columns = {0, mapped_line_numbers,
+                                        doubled_values};
+
+  for (int first = 0; first < count; first += MAP_BATCH) {
+    columns.count = count - first < MAP_BATCH ? count - first : MAP_BATCH;
+    for (int i = 0; i < columns.count; i++) {
+      line_numbers[i] = input[first + i].line_number;
+      values[i] = input[first + i].value;
+    }
+    mapBatch(&columns, &mapped_columns);
+    for (int i = 0; i < columns.count; i++) {
+      mapped[first + i].line_number = mapped_line_numbers[i];
+      mapped[first + i].doubled_value = doubled_values[i];
+    }
+  }
+}
+void doubleValues(const int *restrict values, int *restrict doubled,
+                  int count) {
+  // No aliasing, no calls and no branches, so the compiler vectorizes this
+  // (a shift per lane). Unsigned arithmetic gives the same wrapped result
+  // map() has in practice, without signed overflow.
+  for (int i = 0; i < count; i++) {
+    doubled[i] = (int)((uint32_t)values[i] << 1);
+  }
+}
+void benchMap(void) {
+  // Records per second of the per-record map() over structs against
+  // mapBatch() over columns, on the same values, for a batch that stays in
+  // cache and one that streams from memory. Prints CSV.
+  const int sizes[] = {1 << 14, 1 << 24};
+  const long total_records = 1L << 28;
 
-  // Search for existing entry with this doubled_value
-  int found_index = -1;
+  printf("records,layout,mrecords_per_s\n");
+  for (int s = 0; s < (int)(sizeof(sizes) / sizeof(int)); s++) {
+    int num_records = sizes[s];
+    long repeats = total_records / num_records;
+    Input *rows = malloc(num_records * sizeof(Input));
+    IntermediateInput *mapped_rows =
+        malloc(num_records * sizeof(*mapped_rows));
+    InputColumns columns;
+    IntermediateColumns mapped_columns;
+    struct timespec start;
+    double row_seconds, column_seconds;
+    uint32_t state = 12345;
 
-  for (int i = 0; i < *result_count; i++) {
-    if (output[i].doubled_value == input->doubled_value) {
-      found_index = i;
-      break;
+    columns.count = num_records;
+    columns.line_numbers = malloc(num_records * sizeof(int));
+    columns.values = malloc(num_records * sizeof(int));
+    mapped_columns.line_numbers = malloc(num_records * sizeof(int));
+    mapped_columns.doubled_values = malloc(num_records * sizeof(int));
+    for (int i = 0; i < num_records; i++) {
+      state = state * 1103515245 + 12345;
+      rows[i].line_number = columns.line_numbers[i] = i + 1;
+      rows[i].value = columns.values[i] = (int)(state >> 8) - (1 << 22);
+    }
+    // Fault every output page in before timing
+    memset(mapped_rows, 0, num_records * sizeof(*mapped_rows));
+    memset(mapped_columns.line_numbers, 0, num_records * sizeof(int));
+    memset(mapped_columns.doubled_values, 0, num_records * sizeof(int));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long r = 0; r < repeats; r++) {
+      for (int i = 0; i < num_records; i++) {
+        map(&rows[i], &mapped_rows[i]);
+      }
+      // Keep the compiler from merging the repeats into one
+      __asm__ volatile("" : : "r"(mapped_rows) : "memory");
     }
+    row_seconds = secondsSince(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long r = 0; r < repeats; r++) {
+      mapBatch(&columns, &mapped_columns);
+      __asm__ volatile("" : : "r"(mapped_columns.doubled_values) : "memory");
+    }
+    column_seconds = secondsSince(&start);
+
+    for (int i = 0; i < num_records; i++) {
+      if (mapped_rows[i].line_number != mapped_columns.line_numbers[i] ||
+          mapped_rows[i].doubled_value != mapped_columns.doubled_values[i]) {
+        fprintf(stderr, "bench: map and mapBatch disagree at record %d\n", i);
+        exit(1);
+      }
+    }
+    printf("%d,rows,%.0f\n", num_records,
+           repeats * num_records / row_seconds / 1e6);
+    printf("%d,columns,%.0f\n", num_records,
+           repeats * num_records / column_seconds / 1e6);
+
+    free(rows);
+    free(mapped_rows);
+    free(columns.line_numbers);
+    free(columns.values);
+    free(mapped_columns.line_numbers);
+    free(mapped_columns.doubled_values);
   }
-  if (found_index != -1) {
-    // Found existing entry - add line number to it
-    output[found_index].line_numbers[output[found_index].count] =
-        input->line_number;
-    output[found_index].count++;
-  } else {
-    // Not found - create new entry
-    output[*result_count].doubled_value = input->doubled_value;
-    output[*result_count].line_numbers[0] = input->line_number;
-    output[*result_count].count = 1;
-    (*result_count)++;
+}
+uint32_t hashKey(int key) {
+  // murmur3 finalizer: doubled values are all even, so the raw key would
+  // leave half of the low bits unused
+  uint32_t h = (uint32_t)key;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+int partitionFor(int key, int num_partitions) {
+  // The top bits pick the partition; the index slots use the low bits
+  return (int)(((uint64_t)hashKey(key) * num_partitions) >> 32);
+}
+int partitionOf(int key) { return partitionFor(key, NUM_PARTITIONS); }
+void initKeyIndex(KeyIndex *index, int max_keys) {
+  // At least twice as many slots as keys, a power of 2. Sized in size_t:
+  // for more than 2^30 keys that is 2^32 slots, which a uint32_t would wrap
+  // to 0; the mask still fits, as max_keys is at most INT_MAX.
+  size_t capacity = 2;
+
+  while (capacity < 2 * (size_t)max_keys) {
+    capacity *= 2;
+  }
+  index->keys = malloc(capacity * sizeof(int));
+  index->groups = malloc(capacity * sizeof(int));
+  if (index->keys == NULL || index->groups == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  index->mask = (uint32_t)(capacity - 1);
+  for (size_t i = 0; i < capacity; i++) {
+    index->groups[i] = -1;
+  }
+}
+void freeKeyIndex(KeyIndex *index) {
+  free(index->keys);
+  free(index->groups);
+}
+int findOrAddGroup(KeyIndex *index, int key, int *num_groups) {
+  uint32_t slot = hashKey(key) & index->mask;
+
+  while (index->groups[slot] != -1) {
+    if (index->keys[slot] == key) {
+      return index->groups[slot];
+    }
+    slot = (slot + 1) & index->mask;
   }
+  index->keys[slot] = key;
+  index->groups[slot] = (*num_groups)++;
+  return index->groups[slot];
+}
+void groupByKey(IntermediateInput *input, int input_size,
+                GroupedOutput *grouped) {
+  // Group entries with a hash shuffle instead of scanning every output entry
+  // per record. Output order matches the old linear scan: groups appear in
+  // order of their first record, line numbers in record order.
+  int partition_start[NUM_PARTITIONS + 1] = {0};
+  int fill[NUM_PARTITIONS];
+  int *order = malloc((input_size + 1) * sizeof(int));
+  int *group_of = malloc((input_size + 1) * sizeof(int));
+  int *group_output = malloc((input_size + 1) * sizeof(int));
+  int *fill_at;
+
+  // Shuffle: bucket the records by partition, keeping their relative order
+  for (int i = 0; i < input_size; i++) {
+    partition_start[partitionOf(input[i].doubled_value) + 1]++;
+  }
+  for (int p = 0; p < NUM_PARTITIONS; p++) {
+    partition_start[p + 1] += partition_start[p];
+    fill[p] = partition_start[p];
+  }
+  for (int i = 0; i < input_size; i++) {
+    order[fill[partitionOf(input[i].doubled_value)]++] = i;
+  }
+
+  // Group each partition through its own hash index: O(1) average per
+  // record. A partition has at most as many groups as records, so group ids
+  // offset by partition_start are unique across partitions.
+  for (int p = 0; p < NUM_PARTITIONS; p++) {
+    int num_groups = 0;
+    KeyIndex index;
+
+    initKeyIndex(&index, partition_start[p + 1] - partition_start[p]);
+    for (int i = partition_start[p]; i < partition_start[p + 1]; i++) {
+      int record = order[i];
+      group_of[record] = partition_start[p] +
+                         findOrAddGroup(&index, input[record].doubled_value,
+                                        &num_groups);
+    }
+    freeKeyIndex(&index);
+  }
+
+  // Counting pass in record order: a group gets its output slot when its
+  // first record is seen, and the slot's size is tallied
+  grouped->count = 0;
+  grouped->keys = malloc((input_size + 1) * sizeof(int));
+  grouped->offsets = calloc(input_size + 2, sizeof(int));
+  grouped->line_numbers = malloc((input_size + 1) * sizeof(int));
+  for (int g = 0; g < input_size; g++) {
+    group_output[g] = -1;
+  }
+  for (int i = 0; i < input_size; i++) {
+    int g = group_of[i];
+    if (group_output[g] == -1) {
+      group_output[g] = grouped->count++;
+      grouped->keys[group_output[g]] = input[i].doubled_value;
+    }
+    grouped->offsets[group_output[g] + 1]++;
+  }
+
+  // Prefix sums turn sizes into offsets; a second pass in record order then
+  // drops every line number into its group's next free position
+  for (int g = 0; g < grouped->count; g++) {
+    grouped->offsets[g + 1] += grouped->offsets[g];
+  }
+  fill_at = malloc((grouped->count + 1) * sizeof(int));
+  memcpy(fill_at, grouped->offsets, grouped->count * sizeof(int));
+  for (int i = 0; i < input_size; i++) {
+    grouped->line_numbers[fill_at[group_output[group_of[i]]]++] =
+        input[i].line_number;
+  }
+
+  free(fill_at);
+  free(order);
+  free(group_of);
+  free(group_output);
+}
+void groupByKeyRadix(IntermediateInput *input, int input_size,
+                     GroupedOutput *grouped) {
+  // Stable LSD radix sort of the records by key, a byte per pass, then one
+  // scan that cuts the sorted records into runs of equal keys. No hashing
+  // and no comparisons; stability keeps each group's line numbers in
+  // record order. Groups come out in key order.
+  IntermediateInput *from = malloc((input_size + 1) * sizeof(*from));
+  IntermediateInput *to = malloc((input_size + 1) * sizeof(*to));
+  int counts[4][256] = {{0}};
+
+  // Flipping the sign bit makes unsigned digit order match int order. All
+  // four histograms come from one read of the records.
+  memcpy(from, input, input_size * sizeof(*from));
+  for (int i = 0; i < input_size; i++) {
+    uint32_t key = (uint32_t)input[i].doubled_value ^ 0x80000000u;
+    counts[0][key & 0xff]++;
+    counts[1][(key >> 8) & 0xff]++;
+    counts[2][(key >> 16) & 0xff]++;
+    counts[3][key >> 24]++;
+  }
+  for (int pass = 0; pass < 4; pass++) {
+    int shift = 8 * pass;
+    int *count = counts[pass];
+    int offset = 0;
+
+    // A byte every key shares (common for small or dense keys) leaves the
+    // order unchanged, so its pass is skipped
+    if (input_size == 0 ||
+        count[(((uint32_t)from[0].doubled_value ^ 0x80000000u) >> shift) &
+              0xff] == input_size) {
+      continue;
+    }
+    for (int digit = 0; digit < 256; digit++) {
+      int size = count[digit];
+      count[digit] = offset;
+      offset += size;
+    }
+    for (int i = 0; i < input_size; i++) {
+      uint32_t key = (uint32_t)from[i].doubled_value ^ 0x80000000u;
+      to[count[(key >> shift) & 0xff]++] = from[i];
+    }
+    IntermediateInput *swap = from;
+    from = to;
+    to = swap;
+  }
+
+  grouped->count = 0;
+  grouped->keys = malloc((input_size + 1) * sizeof(int));
+  grouped->offsets = malloc((input_size + 2) * sizeof(int));
+  grouped->line_numbers = malloc((input_size + 1) * sizeof(int));
+  for (int i = 0; i < input_size; i++) {
+    if (i == 0 || from[i].doubled_value != from[i - 1].doubled_value) {
+      grouped->keys[grouped->count] = from[i].doubled_value;
+      grouped->offsets[grouped->count++] = i;
+    }
+    grouped->line_numbers[i] = from[i].line_number;
+  }
+  grouped->offsets[grouped->count] = input_size;
+
+  free(from);
+  free(to);
+}
+void benchGrouping(void) {
+  // Time hash and radix grouping on the same synthetic records across key
+  // cardinalities, with keys both dense (consecutive even values, as
+  // doubling small inputs gives) and sparse (spread over all 32 bits).
+  // Prints CSV; the two strategies must agree on the number of groups.
+  const int num_records = 1 << 22;
+  const int cardinalities[] = {16, 1024, 65536, 1 << 20, 1 << 22};
+  IntermediateInput *records = malloc(num_records * sizeof(*records));
+  int *pool = malloc((1 << 22) * sizeof(int));
+  uint64_t state = 0x9e3779b97f4a7c15ull;
+
+  printf("records,keys,distribution,hash_ms,radix_ms,radix_speedup\n");
+  for (int c = 0; c < (int)(sizeof(cardinalities) / sizeof(int)); c++) {
+    for (int sparse = 0; sparse <= 1; sparse++) {
+      int keys = cardinalities[c];
+      GroupedOutput hashed, sorted;
+      struct timespec start;
+      double hash_seconds, radix_seconds;
+
+      // xorshift64: fixed seed, so every run sees the same records
+      for (int k = 0; k < keys; k++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        pool[k] = sparse ? (int)(uint32_t)state & ~1 : 2 * k;
+      }
+      for (int i = 0; i < num_records; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        records[i].line_number = i + 1;
+        records[i].doubled_value = pool[(state >> 32) % keys];
+      }
+
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      groupByKey(records, num_records, &hashed);
+      hash_seconds = secondsSince(&start);
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      groupByKeyRadix(records, num_records, &sorted);
+      radix_seconds = secondsSince(&start);
+
+      if (hashed.count != sorted.count) {
+        fprintf(stderr, "bench: %d hash groups but %d radix groups\n",
+                hashed.count, sorted.count);
+        exit(1);
+      }
+      printf("%d,%d,%s,%.1f,%.1f,%.2f\n", num_records, hashed.count,
+             sparse ? "sparse" : "dense", hash_seconds * 1000,
+             radix_seconds * 1000, hash_seconds / radix_seconds);
+      fflush(stdout);
+      freeGroupedOutput(&hashed);
+      freeGroupedOutput(&sorted);
+    }
+  }
+  free(records);
+  free(pool);
+}
+Output getGroup(GroupedOutput *grouped, int g) {
+  Output group;
+  group.doubled_value = grouped->keys[g];
+  group.line_numbers = grouped->line_numbers + grouped->offsets[g];
+  group.count = grouped->offsets[g + 1] - grouped->offsets[g];
+  return group;
+}
+void freeGroupedOutput(GroupedOutput *grouped) {
+  free(grouped->keys);
+  free(grouped->offsets);
+  free(grouped->line_numbers);
 }
 void reduce(Output *output) {
-  // Print the doubled number and line numbers
-  printf("(%d, [", output->doubled_value);
+  OutputSink *sink = current_sink;
+
+  if (binary_output) {
+    // Key, count, then the line numbers, all little-endian int32. A big
+    // group skips the buffer: writev sends it straight from the group.
+    reserveSink(sink, 8);
+    putInt32(sink->buffer + sink->len, output->doubled_value);
+    putInt32(sink->buffer + sink->len + 4, output->count);
+    sink->len += 8;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (output->count >= SINK_DIRECT_COUNT) {
+      flushSink(sink, output->line_numbers, output->count * sizeof(int));
+      return;
+    }
+#endif
+    reserveSink(sink, 4 * (size_t)output->count);
+    for (int i = 0; i < output->count; i++) {
+      putInt32(sink->buffer + sink->len, output->line_numbers[i]);
+      sink->len += 4;
+    }
+  } else {
+    // Print the doubled number and line numbers, with commas between them.
+    // Reserve room for the whole line so a flush never splits it.
+    char digits[12];
+    char *out, *start;
+
+    reserveSink(sink, 16 + 13 * (size_t)output->count);
+    out = sink->buffer + sink->len;
+    *out++ = '(';
+    start = formatInt(digits + sizeof(digits), output->doubled_value);
+    memcpy(out, start, digits + sizeof(digits) - start);
+    out += digits + sizeof(digits) - start;
+    memcpy(out, ", [", 3);
+    out += 3;
+    for (int i = 0; i < output->count; i++) {
+      if (i > 0) {
+        memcpy(out, ", ", 2);
+        out += 2;
+      }
+      start = formatInt(digits + sizeof(digits), output->line_numbers[i]);
+      memcpy(out, start, digits + sizeof(digits) - start);
+      out += digits + sizeof(digits) - start;
+    }
+    memcpy(out, "])\n", 3);
+    out += 3;
+    sink->len = out - sink->buffer;
+  }
+  if (sink->len >= SINK_FLUSH) {
+    flushSink(sink, NULL, 0);
+  }
+}
+void openSink(OutputSink *sink, int shard) {
+  // Make sink the calling thread's reduce output: shard file <prefix>.<n>
+  // when sharding, else the shared stdout
+  if (output_prefix != NULL) {
+    char path[4096];
+    shardPath(path, sizeof(path), shard, shard_attempt);
+    sink->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (sink->fd == -1) {
+      perror(path);
+      exit(1);
+    }
+    sink->shared = 0;
+  } else {
+    // Anything printf'ed so far must come out first
+    fflush(stdout);
+    sink->fd = STDOUT_FILENO;
+    sink->shared = 1;
+  }
+  sink->len = 0;
+  sink->capacity = 2 * SINK_FLUSH;
+  sink->buffer = malloc(sink->capacity);
+  if (sink->buffer == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  current_sink = sink;
+}
+void closeSink(OutputSink *sink) {
+  flushSink(sink, NULL, 0);
+  if (!sink->shared) {
+    close(sink->fd);
+  }
+  free(sink->buffer);
+  sink->buffer = NULL;
+  current_sink = NULL;
+}
+void reserveSink(OutputSink *sink, size_t bytes) {
+  // Make room for bytes more output, flushing first if the buffer would
+  // pass the flush size, and growing it only for a group larger than that
+  if (sink->len + bytes > SINK_FLUSH && sink->len > 0) {
+    flushSink(sink, NULL, 0);
+  }
+  if (sink->len + bytes > sink->capacity) {
+    sink->capacity = sink->len + bytes;
+    sink->buffer = realloc(sink->buffer, sink->capacity);
+    if (sink->buffer == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+}
+void flushSink(OutputSink *sink, const void *extra, size_t extra_len) {
+  // Write the buffer, followed by extra_len bytes at extra, in one writev
+  // loop; partial writes resume where they stopped
+  struct iovec iov[2] = {{sink->buffer, sink->len},
+                         {(void *)extra, extra_len}};
+  struct iovec *next = iov;
+  int count = extra_len > 0 ? 2 : 1;
+
+  if (sink->shared) {
+    pthread_mutex_lock(&stdout_lock);
+  }
+  while (count > 0) {
+    ssize_t wrote = writev(sink->fd, next, count);
+    if (wrote == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("write");
+      exit(1);
+    }
+    while (count > 0 && (size_t)wrote >= next->iov_len) {
+      wrote -= next->iov_len;
+      next++;
+      count--;
+    }
+    if (count > 0) {
+      next->iov_base = (char *)next->iov_base + wrote;
+      next->iov_len -= wrote;
+    }
+  }
+  if (sink->shared) {
+    pthread_mutex_unlock(&stdout_lock);
+  }
+  sink->len = 0;
+}
+char *formatInt(char *end, int value) {
+  // Write value in decimal so that it ends just before end, two digits per
+  // step from a table; returns where it starts (at most 11 bytes back)
+  static const char pairs[] =
+      "000102030405060708091011121314151617181920212223242526272829"
+      "303132333435363738394041424344454647484950515253545556575859"
+      "606162636465666768697071727374757677787980818283848586878889"
+      "90919293949596979899";
+  uint32_t v = value < 0 ? 0u - (uint32_t)value : (uint32_t)value;
+
+  while (v >= 100) {
+    end -= 2;
+    memcpy(end, &pairs[(v % 100) * 2], 2);
+    v /= 100;
+  }
+  if (v >= 10) {
+    end -= 2;
+    memcpy(end, &pairs[v * 2], 2);
+  } else {
+    *--end = (char)('0' + v);
+  }
+  if (value < 0) {
+    *--end = '-';
+  }
+  return end;
+}
+void putInt32(char *out, int value) {
+  uint32_t v = (uint32_t)value;
+  out[0] = (char)v;
+  out[1] = (char)(v >> 8);
+  out[2] = (char)(v >> 16);
+  out[3] = (char)(v >> 24);
+}
+void *workerThread(void *arg) {
+  Worker *self = (Worker *)arg;
+  int slice_size = self->end - self->start;
+
+  mapAndBucket(self->input, self->start, self->end, self->num_workers,
+               self->mapped, self->bucket_start);
+
+  // Pre-aggregate each outgoing bucket so only partial groups cross over
+  if (self->combiner != NULL) {
+    for (int p = 0; p < self->num_workers; p++) {
+      self->combiner(&self->mapped[self->bucket_start[p]],
+                     self->bucket_start[p + 1] - self->bucket_start[p],
+                     &self->partials[p]);
+      self->shuffled += self->partials[p].count;
+    }
+  } else {
+    self->shuffled = slice_size;
+  }
+
+  pthread_barrier_wait(self->barrier);
+
+  OutputSink sink;
+  openSink(&sink, self->id);
+  if (self->combiner != NULL) {
+    GroupedOutput groups;
+    mergePartials(self, &groups);
+    for (int g = 0; g < groups.count; g++) {
+      Output group = getGroup(&groups, g);
+      reduce(&group);
+    }
+    freeGroupedOutput(&groups);
+    closeSink(&sink);
+    return NULL;
+  }
+
+  // Gather our partition from every worker. Workers hold consecutive input
+  // slices, so walking them in order keeps the records in input order.
+  int partition_size = 0;
+  for (int w = 0; w < self->num_workers; w++) {
+    Worker *other = &self->workers[w];
+    partition_size +=
+        other->bucket_start[self->id + 1] - other->bucket_start[self->id];
+  }
+  IntermediateInput *partition =
+      malloc((partition_size + 1) * sizeof(*partition));
+  GroupedOutput groups;
+  int n = 0;
+  for (int w = 0; w < self->num_workers; w++) {
+    Worker *other = &self->workers[w];
+    for (int i = other->bucket_start[self->id];
+         i < other->bucket_start[self->id + 1]; i++) {
+      partition[n++] = other->mapped[i];
+    }
+  }
+
+  group_records(partition, partition_size, &groups);
+  for (int g = 0; g < groups.count; g++) {
+    Output group = getGroup(&groups, g);
+    reduce(&group);
+  }
+  closeSink(&sink);
+
+  free(partition);
+  freeGroupedOutput(&groups);
+  return NULL;
+}
+void mapAndBucket(Input *input, int start, int end, int num_partitions,
+                  IntermediateInput *mapped, int *bucket_start) {
+  // Map input[start, end), then bucket the records into mapped by the
+  // partition that owns their key, keeping record order inside each bucket.
+  // The offsets are counted privately and copied out only once final, as a
+  // backup map attempt may be writing the same shared bucket_start: every
+  // store to it then puts the value that is already there.
+  int slice_size = end - start;
+  IntermediateInput *local = malloc((slice_size + 1) * sizeof(*local));
+  int *offsets = calloc(num_partitions + 1, sizeof(int));
+  int *fill = malloc(num_partitions * sizeof(int));
+
+  if (local == NULL || offsets == NULL || fill == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  mapRecords(&input[start], slice_size, local);
+  for (int i = 0; i < slice_size; i++) {
+    offsets[partitionFor(local[i].doubled_value, num_partitions) + 1]++;
+  }
+  for (int p = 0; p < num_partitions; p++) {
+    offsets[p + 1] += offsets[p];
+    fill[p] = offsets[p];
+  }
+  for (int i = 0; i < slice_size; i++) {
+    int p = partitionFor(local[i].doubled_value, num_partitions);
+    mapped[fill[p]++] = local[i];
+  }
+  memcpy(bucket_start, offsets, (num_partitions + 1) * sizeof(int));
+  free(local);
+  free(offsets);
+  free(fill);
+}
+void combineLineNumbers(IntermediateInput *records, int count,
+                        GroupedOutput *partial) {
+  // The default combiner: a partial group is a key with the list of line
+  // numbers this worker saw for it, exactly what groupByKey builds
+  groupByKey(records, count, partial);
+}
+void mergePartials(Worker *self, GroupedOutput *grouped) {
+  // Combine the partial groups for our partition from every worker. Walking
+  // workers in slice order keeps groups in order of first appearance and
+  // line numbers in input order, as if the raw records had been shuffled.
+  int num_partials = 0, num_lines = 0, num_groups = 0;
+  KeyIndex index;
+
+  for (int w = 0; w < self->num_workers; w++) {
+    GroupedOutput *partial = &self->workers[w].partials[self->id];
+    num_partials += partial->count;
+    num_lines += partial->offsets[partial->count];
+  }
+  initKeyIndex(&index, num_partials);
+  grouped->keys = malloc((num_partials + 1) * sizeof(int));
+  grouped->offsets = calloc(num_partials + 2, sizeof(int));
+  grouped->line_numbers = malloc((num_lines + 1) * sizeof(int));
+
+  // Counting pass: size every final group
+  for (int w = 0; w < self->num_workers; w++) {
+    GroupedOutput *partial = &self->workers[w].partials[self->id];
+    for (int g = 0; g < partial->count; g++) {
+      int final = findOrAddGroup(&index, partial->keys[g], &num_groups);
+      grouped->keys[final] = partial->keys[g];
+      grouped->offsets[final + 1] +=
+          partial->offsets[g + 1] - partial->offsets[g];
+    }
+  }
+  grouped->count = num_groups;
+  for (int g = 0; g < num_groups; g++) {
+    grouped->offsets[g + 1] += grouped->offsets[g];
+  }
+
+  // Copy each partial list into place; the index lookups repeat the first
+  // pass, and fill_at tracks how much of each final group is written
+  int *fill_at = malloc((num_groups + 1) * sizeof(int));
+  memcpy(fill_at, grouped->offsets, num_groups * sizeof(int));
+  for (int w = 0; w < self->num_workers; w++) {
+    GroupedOutput *partial = &self->workers[w].partials[self->id];
+    for (int g = 0; g < partial->count; g++) {
+      int final = findOrAddGroup(&index, partial->keys[g], &num_groups);
+      int size = partial->offsets[g + 1] - partial->offsets[g];
+      memcpy(&grouped->line_numbers[fill_at[final]],
+             &partial->line_numbers[partial->offsets[g]], size * sizeof(int));
+      fill_at[final] += size;
+    }
+  }
+
+  free(fill_at);
+  freeKeyIndex(&index);
+}
+void runParallel(Input *input_data, int input_size, int num_workers,
+                 Combiner combiner) {
+  // Keys never straddle workers, so each group is reduced exactly once and
+  // its line numbers come out as in sequential mode; only the order of the
+  // groups across workers differs
+  pthread_t threads[num_workers];
+  Worker workers[num_workers];
+  pthread_barrier_t barrier;
+
+  pthread_barrier_init(&barrier, NULL, num_workers);
+  for (int w = 0; w < num_workers; w++) {
+    workers[w].id = w;
+    workers[w].num_workers = num_workers;
+    workers[w].input = input_data;
+    workers[w].start = (int)((long)input_size * w / num_workers);
+    workers[w].end = (int)((long)input_size * (w + 1) / num_workers);
+    workers[w].mapped = malloc(
+        (workers[w].end - workers[w].start + 1) * sizeof(IntermediateInput));
+    workers[w].bucket_start = calloc(num_workers + 1, sizeof(int));
+    workers[w].combiner = combiner;
+    workers[w].partials =
+        combiner ? calloc(num_workers, sizeof(GroupedOutput)) : NULL;
+    workers[w].shuffled = 0;
+    workers[w].workers = workers;
+    workers[w].barrier = &barrier;
+  }
+  for (int w = 0; w < num_workers; w++) {
+    pthread_create(&threads[w], NULL, workerThread, &workers[w]);
+  }
+  for (int w = 0; w < num_workers; w++) {
+    pthread_join(threads[w], NULL);
+  }
+  long shuffled = 0;
+  for (int w = 0; w < num_workers; w++) {
+    shuffled += workers[w].shuffled;
+    if (combiner != NULL) {
+      for (int p = 0; p < num_workers; p++) {
+        freeGroupedOutput(&workers[w].partials[p]);
+      }
+      free(workers[w].partials);
+    }
+    free(workers[w].mapped);
+    free(workers[w].bucket_start);
+  }
+  if (combiner != NULL) {
+    // Report how much the combiner shrank the shuffle
+    fprintf(stderr,
+            "combiner: %d mapped records -> %ld shuffled (%.1f%% fewer)\n",
+            input_size, shuffled,
+            input_size ? 100.0 * (input_size - shuffled) / input_size : 0.0);
+  }
+  pthread_barrier_destroy(&barrier);
+}
+void runProcesses(Input *input_data, int input_size, int num_tasks) {
+  // Same dataflow as runParallel, but every map and reduce task is its own
+  // process: a crashing task takes down only itself and is re-executed, and
+  // one that runs far longer than its peers gets a backup attempt. Map tasks
+  // write into shared memory and exit; reduce tasks then read their
+  // partition from it and send their output back over a pipe.
+  ProcessJob job;
+  Task *tasks = calloc(num_tasks, sizeof(Task));
+  size_t mapped_bytes = (input_size + 1) * sizeof(IntermediateInput);
+  size_t bucket_bytes = (size_t)num_tasks * (num_tasks + 1) * sizeof(int);
+
+  job.num_tasks = num_tasks;
+  job.input = input_data;
+  job.slice_start = malloc((num_tasks + 1) * sizeof(int));
+  for (int w = 0; w <= num_tasks; w++) {
+    job.slice_start[w] = (int)((long)input_size * w / num_tasks);
+  }
+  job.mapped = mmap(NULL, mapped_bytes, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  job.bucket_start = mmap(NULL, bucket_bytes, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (job.mapped == MAP_FAILED || job.bucket_start == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+
+  runPhase(&job, tasks, 0);
+  runPhase(&job, tasks, 1);
+
+  for (int t = 0; t < num_tasks; t++) {
+    free(tasks[t].running[0].output);
+    free(tasks[t].running[1].output);
+  }
+  munmap(job.mapped, mapped_bytes);
+  munmap(job.bucket_start, bucket_bytes);
+  free(job.slice_start);
+  free(tasks);
+}
+void runPhase(ProcessJob *job, Task *tasks, int reducing) {
+  // Start every task of the phase, then supervise until all have succeeded:
+  // drain reducer pipes so no reducer blocks on a full pipe, reap exits,
+  // restart failures and back up stragglers. Map attempts of one task only
+  // ever store their final records and offsets to shared memory, the same
+  // values from either attempt, so a backup racing its original cannot
+  // leave a half-built bucket behind; the loser is stopped before the
+  // phase ends.
+  const char *phase = reducing ? "reduce" : "map";
+  int num_tasks = job->num_tasks;
+  int remaining = num_tasks;
+  double slowest = 0;
+  struct pollfd *fds = malloc((2 * num_tasks + 1) * sizeof(struct pollfd));
+  Attempt **fd_attempt = malloc((2 * num_tasks + 1) * sizeof(Attempt *));
+
+  for (int t = 0; t < num_tasks; t++) {
+    tasks[t].attempts = 0;
+    tasks[t].done = 0;
+    for (int a = 0; a < 2; a++) {
+      tasks[t].running[a].pid = 0;
+      tasks[t].running[a].shard = -1;
+      tasks[t].running[a].output_fd = -1;
+    }
+    startTask(job, &tasks[t], t, reducing);
+  }
+  while (remaining > 0) {
+    int num_fds = 0;
+    int status;
+    pid_t pid;
+
+    // The poll timeout doubles as the supervision tick
+    for (int t = 0; t < num_tasks; t++) {
+      for (int a = 0; a < 2; a++) {
+        Attempt *attempt = &tasks[t].running[a];
+        if (attempt->pid != 0 && attempt->output_fd != -1) {
+          fds[num_fds].fd = attempt->output_fd;
+          fds[num_fds].events = POLLIN;
+          fd_attempt[num_fds++] = attempt;
+        }
+      }
+    }
+    if (poll(fds, num_fds, 100) > 0) {
+      for (int i = 0; i < num_fds; i++) {
+        Attempt *attempt = fd_attempt[i];
+        if (fds[i].revents != 0 && readOutput(attempt) <= 0) {
+          close(attempt->output_fd);
+          attempt->output_fd = -1;
+        }
+      }
+    }
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      int t, a = 0;
+      for (t = 0; t < num_tasks; t++) {
+        if (tasks[t].running[0].pid == pid || tasks[t].running[1].pid == pid) {
+          a = tasks[t].running[1].pid == pid;
+          break;
+        }
+      }
+      if (t == num_tasks) {
+        continue;
+      }
+      Task *task = &tasks[t];
+      Attempt *attempt = &task->running[a];
+      Attempt *other = &task->running[!a];
+      attempt->pid = 0;
+      if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        // The writer is gone, so the rest of its output is already in the
+        // pipe; pass the whole attempt's output on only now
+        while (attempt->output_fd != -1 && readOutput(attempt) > 0) {
+        }
+        if (attempt->output_fd != -1) {
+          close(attempt->output_fd);
+          attempt->output_fd = -1;
+        }
+        if (attempt->output_len > 0) {
+          fwrite(attempt->output, 1, attempt->output_len, stdout);
+          fflush(stdout);
+        }
+        if (attempt->shard != -1) {
+          char from[4096], to[4096];
+          shardPath(from, sizeof(from), t, attempt->number);
+          shardPath(to, sizeof(to), t, 0);
+          if (rename(from, to) == -1) {
+            perror(to);
+            exit(1);
+          }
+          attempt->shard = -1;
+        }
+        stopAttempt(other);
+        task->done = 1;
+        remaining--;
+        if (secondsSince(&attempt->started) > slowest) {
+          slowest = secondsSince(&attempt->started);
+        }
+        fprintf(stderr, "%s: %d/%d tasks done\n", phase,
+                num_tasks - remaining, num_tasks);
+        continue;
+      }
+
+      if (WIFSIGNALED(status)) {
+        fprintf(stderr, "%s task %d killed by signal %d (attempt %d)\n",
+                phase, t, WTERMSIG(status), attempt->number);
+      } else {
+        fprintf(stderr, "%s task %d exited with status %d (attempt %d)\n",
+                phase, t, WEXITSTATUS(status), attempt->number);
+      }
+      stopAttempt(attempt);
+      if (other->pid != 0) {
+        // Its other attempt is still going
+        continue;
+      }
+      if (task->attempts >= MAX_ATTEMPTS) {
+        fprintf(stderr, "%s task %d failed %d times, giving up\n", phase, t,
+                MAX_ATTEMPTS);
+        for (int u = 0; u < num_tasks; u++) {
+          stopAttempt(&tasks[u].running[0]);
+          stopAttempt(&tasks[u].running[1]);
+        }
+        exit(1);
+      }
+      startTask(job, task, t, reducing);
+    }
+
+    // Back up stragglers without stopping them: a task that is slow only
+    // because it has more work than the rest keeps its head start
+    double limit = STRAGGLER_FACTOR * (slowest > STRAGGLER_MIN_SECONDS
+                                           ? slowest
+                                           : STRAGGLER_MIN_SECONDS);
+    for (int t = 0; t < num_tasks && remaining < num_tasks; t++) {
+      Task *task = &tasks[t];
+      Attempt *only = task->running[0].pid != 0 ? &task->running[0]
+                                                : &task->running[1];
+      if (!task->done && task->attempts < MAX_ATTEMPTS &&
+          (task->running[0].pid != 0) + (task->running[1].pid != 0) == 1 &&
+          secondsSince(&only->started) > limit) {
+        fprintf(stderr,
+                "%s task %d is straggling after %.1fs, starting a backup\n",
+                phase, t, secondsSince(&only->started));
+        startTask(job, task, t, reducing);
+      }
+    }
+  }
+
+  free(fds);
+  free(fd_attempt);
+}
+void startTask(ProcessJob *job, Task *task, int id, int reducing) {
+  // Start a new attempt at the task in a free slot. Reduce output comes
+  // back over a pipe unless it goes to shard files.
+  Attempt *attempt =
+      task->running[0].pid == 0 ? &task->running[0] : &task->running[1];
+  int piped = reducing && output_prefix == NULL;
+  int number = task->attempts + 1;
+  int pipe_fds[2];
+  pid_t pid;
+
+  if (piped && pipe(pipe_fds) == -1) {
+    perror("pipe");
+    exit(1);
+  }
+  // Nothing buffered may be inherited, or the child would print it again
+  fflush(stdout);
+  fflush(stderr);
+  pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    if (reducing) {
+      if (piped) {
+        close(pipe_fds[0]);
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        close(pipe_fds[1]);
+      }
+      shard_attempt = number;
+      reduceTask(job, id);
+    } else {
+      mapTask(job, id);
+    }
+    fflush(stdout);
+    _exit(0);
+  }
+
+  task->attempts = number;
+  attempt->pid = pid;
+  attempt->number = number;
+  attempt->shard = reducing && !piped ? id : -1;
+  attempt->output_len = 0;
+  attempt->output_fd = -1;
+  if (piped) {
+    close(pipe_fds[1]);
+    attempt->output_fd = pipe_fds[0];
+  }
+  clock_gettime(CLOCK_MONOTONIC, &attempt->started);
+}
+void stopAttempt(Attempt *attempt) {
+  // Kill a running attempt, reap it and drop whatever it produced
+  if (attempt->pid != 0) {
+    kill(attempt->pid, SIGKILL);
+    waitpid(attempt->pid, NULL, 0);
+    attempt->pid = 0;
+  }
+  if (attempt->output_fd != -1) {
+    close(attempt->output_fd);
+    attempt->output_fd = -1;
+  }
+  if (attempt->shard != -1) {
+    char path[4096];
+    shardPath(path, sizeof(path), attempt->shard, attempt->number);
+    unlink(path);
+    attempt->shard = -1;
+  }
+  attempt->output_len = 0;
+}
+int readOutput(Attempt *attempt) {
+  // Append one read from the attempt's pipe to its output; returns the
+  // bytes read, 0 at end of file
+  ssize_t got;
+
+  if (attempt->output_capacity - attempt->output_len < 65536) {
+    attempt->output_capacity = attempt->output_capacity * 2 + 65536;
+    attempt->output = realloc(attempt->output, attempt->output_capacity);
+    if (attempt->output == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  do {
+    got = read(attempt->output_fd, attempt->output + attempt->output_len,
+               attempt->output_capacity - attempt->output_len);
+  } while (got == -1 && errno == EINTR);
+  if (got == -1) {
+    perror("read");
+    exit(1);
+  }
+  attempt->output_len += got;
+  return (int)got;
+}
+void shardPath(char *path, size_t size, int shard, int attempt) {
+  // Shard file of a reducer: <prefix>.<n>, or <prefix>.<n>.attempt<k> while
+  // attempt k of a multi-process reducer is still writing it
+  if (attempt > 0) {
+    snprintf(path, size, "%s.%d.attempt%d", output_prefix, shard, attempt);
+  } else {
+    snprintf(path, size, "%s.%d", output_prefix, shard);
+  }
+}
+void mapTask(ProcessJob *job, int w) {
+  int n = job->num_tasks;
+  mapAndBucket(job->input, job->slice_start[w], job->slice_start[w + 1], n,
+               job->mapped + job->slice_start[w],
+               job->bucket_start + (size_t)w * (n + 1));
+}
+void reduceTask(ProcessJob *job, int r) {
+  // Gather partition r from every map task's slice, in slice order so the
+  // records stay in input order, then group and reduce it
+  int n = job->num_tasks;
+  int partition_size = 0, count = 0;
+
+  for (int w = 0; w < n; w++) {
+    int *bucket_start = job->bucket_start + (size_t)w * (n + 1);
+    partition_size += bucket_start[r + 1] - bucket_start[r];
+  }
+  IntermediateInput *partition =
+      malloc((partition_size + 1) * sizeof(*partition));
+  for (int w = 0; w < n; w++) {
+    int *bucket_start = job->bucket_start + (size_t)w * (n + 1);
+    IntermediateInput *slice = job->mapped + job->slice_start[w];
+    memcpy(&partition[count], &slice[bucket_start[r]],
+           (bucket_start[r + 1] - bucket_start[r]) * sizeof(*partition));
+    count += bucket_start[r + 1] - bucket_start[r];
+  }
+
+  GroupedOutput groups;
+  OutputSink sink;
+  group_records(partition, partition_size, &groups);
+  openSink(&sink, r);
+  for (int g = 0; g < groups.count; g++) {
+    Output group = getGroup(&groups, g);
+    reduce(&group);
+  }
+  closeSink(&sink);
+  freeGroupedOutput(&groups);
+  free(partition);
+}
+double secondsSince(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+int compareRecords(const void *a, const void *b) {
+  const IntermediateInput *x = a, *y = b;
+  if (x->doubled_value != y->doubled_value) {
+    return x->doubled_value < y->doubled_value ? -1 : 1;
+  }
+  return (x->line_number > y->line_number) - (x->line_number < y->line_number);
+}
+int createSpillFile(void) {
+  // The file is unlinked at once so it vanishes when closed or on a crash
+  const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  char path[4096];
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/lab7-spill-XXXXXX", dir);
+  fd = mkstemp(path);
+  if (fd == -1) {
+    perror("spill file");
+    exit(1);
+  }
+  unlink(path);
+  return fd;
+}
+void writeRecords(int fd, off_t *end, IntermediateInput *records, int count) {
+  // Append the records at *end, resuming after short writes
+  const char *data = (const char *)records;
+  size_t left = (size_t)count * sizeof(IntermediateInput);
+
+  while (left > 0) {
+    ssize_t wrote = pwrite(fd, data, left, *end);
+    if (wrote == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("spill write");
+      exit(1);
+    }
+    data += wrote;
+    left -= wrote;
+    *end += wrote;
+  }
+}
+SpillRun spillRun(int fd, off_t *end, IntermediateInput *records, int count) {
+  // Sort the buffered records by key and append them as one run
+  SpillRun run = {*end, count, NULL, 0, 0, 0, {0, 0}};
+
+  qsort(records, count, sizeof(IntermediateInput), compareRecords);
+  writeRecords(fd, end, records, count);
+  return run;
+}
+int nextFromRun(int fd, SpillRun *run) {
+  // Move the run's next record into head, refilling the buffer as needed;
+  // returns 0 once the run is exhausted
+  if (run->next == run->buffered) {
+    if (run->remaining == 0) {
+      return 0;
+    }
+    int want = run->remaining < run->buffered_max ? (int)run->remaining
+                                                  : run->buffered_max;
+    size_t bytes = (size_t)want * sizeof(IntermediateInput);
+    size_t got = 0;
+    while (got < bytes) {
+      ssize_t n = pread(fd, (char *)run->buffer + got, bytes - got,
+                        run->offset + got);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        perror("spill read");
+        exit(1);
+      }
+      got += n;
+    }
+    run->offset += bytes;
+    run->remaining -= want;
+    run->buffered = want;
+    run->next = 0;
+  }
+  run->head = run->buffer[run->next++];
+  return 1;
+}
+SpillRun mergeRuns(int fd, SpillRun *runs, int num_runs, int buffer_records,
+                   GroupStream *stream, int out_fd, off_t *out_end) {
+  // k-way merge of runs from fd through a min-heap of run indices ordered
+  // by each run's head. The merged records go to stream, or with no stream
+  // are appended to out_fd as one new run, which is returned.
+  SpillRun merged = {out_end ? *out_end : 0, 0, NULL, 0, 0, 0, {0, 0}};
+  IntermediateInput *out = NULL;
+  int out_count = 0;
+  int *heap = malloc(num_runs * sizeof(int));
+  int heap_size = 0;
+
+  if (heap == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  if (stream == NULL) {
+    out = malloc(buffer_records * sizeof(IntermediateInput));
+    if (out == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+  }
+  for (int r = 0; r < num_runs; r++) {
+    runs[r].buffer = malloc(buffer_records * sizeof(IntermediateInput));
+    if (runs[r].buffer == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+    runs[r].buffered_max = buffer_records;
+    runs[r].buffered = runs[r].next = 0;
+    if (nextFromRun(fd, &runs[r])) {
+      int i = heap_size++;
+      while (i > 0 && compareRecords(&runs[r].head,
+                                     &runs[heap[(i - 1) / 2]].head) < 0) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+      }
+      heap[i] = r;
+    }
+  }
+  while (heap_size > 0) {
+    int top = heap[0];
+    if (stream != NULL) {
+      streamRecord(stream, &runs[top].head);
+    } else {
+      out[out_count++] = runs[top].head;
+      merged.remaining++;
+      if (out_count == buffer_records) {
+        writeRecords(out_fd, out_end, out, out_count);
+        out_count = 0;
+      }
+    }
+    if (!nextFromRun(fd, &runs[top])) {
+      top = heap[--heap_size];
+    }
+    // Sift the (refilled or replacement) run down from the root
+    int i = 0;
+    for (;;) {
+      int child = 2 * i + 1;
+      if (child >= heap_size) {
+        break;
+      }
+      if (child + 1 < heap_size &&
+          compareRecords(&runs[heap[child + 1]].head,
+                         &runs[heap[child]].head) < 0) {
+        child++;
+      }
+      if (compareRecords(&runs[heap[child]].head, &runs[top].head) >= 0) {
+        break;
+      }
+      heap[i] = heap[child];
+      i = child;
+    }
+    if (heap_size > 0) {
+      heap[i] = top;
+    }
+  }
+  if (out_count > 0) {
+    writeRecords(out_fd, out_end, out, out_count);
+  }
+
+  for (int r = 0; r < num_runs; r++) {
+    free(runs[r].buffer);
+    runs[r].buffer = NULL;
+  }
+  free(out);
+  free(heap);
+  return merged;
+}
+void streamRecord(GroupStream *stream, IntermediateInput *record) {
+  // Records arrive sorted by key: a new key closes the current group
+  if (stream->count > 0 && record->doubled_value != stream->doubled_value) {
+    flushStream(stream);
+  }
+  if (stream->count == stream->capacity) {
+    // A group never holds more than INT_MAX line numbers
+    if (stream->capacity == 0) {
+      stream->capacity = 64;
+    } else {
+      stream->capacity =
+          stream->capacity < INT_MAX / 2 ? stream->capacity * 2 : INT_MAX;
+    }
+    stream->line_numbers =
+        realloc(stream->line_numbers, (size_t)stream->capacity * sizeof(int));
+    if (stream->line_numbers == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  stream->doubled_value = record->doubled_value;
+  stream->line_numbers[stream->count++] = record->line_number;
+}
+void flushStream(GroupStream *stream) {
+  if (stream->count > 0) {
+    Output group = {stream->doubled_value, stream->line_numbers,
+                    stream->count};
+    reduce(&group);
+    stream->count = 0;
+  }
+}
+void runSpill(ValueReader *reader, long budget_bytes) {
+  // External-memory pipeline: mapped records are buffered up to the budget,
+  // each full buffer is sorted and spilled as a run, and a k-way merge of
+  // the runs feeds the groups to reduce as a stream. With more than
+  // MERGE_FAN_IN runs, passes over the spill file first merge them in
+  // groups into longer runs. Groups therefore come out in key order rather
+  // than order of first appearance. Line numbers are ints, so this mode
+  // takes at most INT_MAX records (16 GB of mapped records); more is an
+  // error, caught before any group is written.
+  long buffer_size = budget_bytes / (long)sizeof(IntermediateInput);
+  IntermediateInput *buffer;
+  SpillRun *runs = NULL;
+  int num_runs = 0, run_capacity = 0, count = 0, line_number = 0;
+  int spill_fd = -1;
+  off_t spill_end = 0;
+  GroupStream stream = {0, NULL, 0, 0};
+  OutputSink sink;
+  int value;
+
+  if (buffer_size > 0x7fffffff) {
+    buffer_size = 0x7fffffff;
+  }
+  buffer = malloc((buffer_size + 1) * sizeof(IntermediateInput));
+  if (buffer == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+
+  if (!reader->binary && !binary_output) {
+    printf("Enter values (one per line). Type 'end' to finish:\n");
+  }
+  openSink(&sink, 0);
+  for (;;) {
+    int more = readValue(reader, &value);
+    if (more) {
+      if (line_number == INT_MAX) {
+        fprintf(stderr, "Too many input values: at most %d are supported\n",
+                INT_MAX);
+        exit(1);
+      }
+      Input input = {++line_number, value};
+      map(&input, &buffer[count++]);
+    }
+    // Spill a full buffer, or at the end what is left once anything has
+    // been spilled
+    if ((more && count == buffer_size) || (!more && count > 0 && num_runs)) {
+      if (num_runs == run_capacity) {
+        run_capacity = run_capacity ? run_capacity * 2 : 16;
+        runs = realloc(runs, run_capacity * sizeof(SpillRun));
+        if (runs == NULL) {
+          perror("realloc");
+          exit(1);
+        }
+      }
+      if (spill_fd == -1) {
+        spill_fd = createSpillFile();
+      }
+      runs[num_runs++] = spillRun(spill_fd, &spill_end, buffer, count);
+      count = 0;
+    }
+    if (!more) {
+      break;
+    }
+  }
+
+  if (num_runs == 0) {
+    // Everything fit in the budget: sort in memory and skip the disk
+    qsort(buffer, count, sizeof(IntermediateInput), compareRecords);
+    for (int i = 0; i < count; i++) {
+      streamRecord(&stream, &buffer[i]);
+    }
+    flushStream(&stream);
+    closeSink(&sink);
+    free(buffer);
+    free(stream.line_numbers);
+    return;
+  }
+  free(buffer);
 
-  // Print all line numbers with commas between them
-  for (int i = 0; i < output->count; i++) {
-    printf("%d", output->line_numbers[i]);
+  // Merge passes: each group of MERGE_FAN_IN runs becomes one run of a new
+  // spill file, until few enough runs are left for the final merge. The
+  // read buffers of a merge share the budget.
+  while (num_runs > MERGE_FAN_IN) {
+    int out_fd = createSpillFile();
+    off_t out_end = 0;
+    int merged = 0;
 
-    // Add comma if not the last element
-    if (i < output->count - 1) {
-      printf(", ");
+    for (int first = 0; first < num_runs; first += MERGE_FAN_IN) {
+      int group = num_runs - first < MERGE_FAN_IN ? num_runs - first
+                                                  : MERGE_FAN_IN;
+      runs[merged++] = mergeRuns(spill_fd, &runs[first], group,
+                                 buffer_size / (group + 1) + 1, NULL, out_fd,
+                                 &out_end);
     }
+    close(spill_fd);
+    spill_fd = out_fd;
+    num_runs = merged;
   }
+  mergeRuns(spill_fd, runs, num_runs, buffer_size / (num_runs + 1) + 1,
+            &stream, -1, NULL);
+  flushStream(&stream);
+  closeSink(&sink);
 
-  printf("])\n");
+  close(spill_fd);
+  free(runs);
+  free(stream.line_numbers);
 }
@@ -1,109 +1,861 @@
-#include "uthash.h"
+// Build with: gcc -O2 -pthread lab8.c -lm (the benchmark corpus generator
+// needs libm for pow)
 #include <ctype.h>
+#include <math.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
-// Hash table structure
+// Words are interned into arena blocks of at least this many bytes
+#define ARENA_BLOCK_SIZE (64 * 1024)
+// Slot count of a table's first allocation; always a power of two
+#define TABLE_MIN_CAPACITY 1024
+
+typedef struct arena_block {
+  struct arena_block *next;
+  size_t used;
+  size_t cap;
+  char data[];
+} arena_block_t;
+
+// One slot of the open-addressing table; word == NULL marks an empty slot
 typedef struct {
-  char word[50];
-  int count;
-  UT_hash_handle hh;
+  char *word;    // NUL-terminated copy interned in the table's arena
+  uint64_t hash; // cached so probing and growing never rehash the bytes
+  uint32_t len;
+  long count;
 } word_count_t;
 
+// Hash table structure: linear probing over one flat slot array. All word
+// bytes live in the arena, so freeing the table is a handful of free()s no
+// matter how many distinct words it holds. A zeroed table is empty.
+typedef struct {
+  word_count_t *slots;
+  size_t capacity;
+  size_t size;
+  arena_block_t *arena;
+} word_table_t;
+
+// Growable buffer a tokenizer assembles the current word in
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} word_buf_t;
+
+// Longest word the heavy-hitter list stores; approximate mode truncates
+// longer words so every entry has a fixed size
+#define APPROX_MAX_WORD_LEN 64
+
+// One tracked word of the Space-Saving list. Its true count lies in
+// [count - error, count].
+typedef struct {
+  char word[APPROX_MAX_WORD_LEN];
+  uint64_t hash;
+  uint32_t len;
+  uint32_t heap_pos;
+  long count;
+  long error;
+} heavy_hitter_t;
+
+// Fixed-size approximate counter: a Count-Min sketch for point estimates
+// plus a Space-Saving list of the capacity heaviest words. Its memory is set
+// by eps, delta and capacity alone, however many distinct words arrive.
+typedef struct {
+  double eps;
+  double delta;
+  size_t width;
+  size_t depth;
+  long *sketch; // depth rows of width counters
+  long total;   // words counted (N)
+  size_t capacity;
+  size_t size;
+  heavy_hitter_t *hitters;
+  uint32_t *heap; // hitter ids, min-heap on count
+  int32_t *index; // open-addressing word -> hitter id, -1 when empty
+  size_t index_mask;
+} approx_counter_t;
+
+// Shards of the concurrent map; a power of two
+#define DEFAULT_NUM_SHARDS 64
+
+// One stripe of the concurrent map, padded to its own cache lines so
+// threads hammering neighbouring shards do not false-share their locks
+typedef struct {
+  pthread_mutex_t lock;
+  word_table_t table;
+} __attribute__((aligned(64))) word_shard_t;
+
+// Lock-striped concurrent counting map: a word lives in the shard picked by
+// the top bits of its hash, so threads only contend when they hit the same
+// shard at the same moment instead of all queueing on count_mutex
+typedef struct {
+  int num_shards;
+  word_shard_t *shards;
+} sharded_table_t;
+
+// Where a tokenizer sends each finished word: an exact table, locked when
+// mutex is set, a fixed-size approximate counter when approx is set, or
+// the shared concurrent map when sharded is set
+typedef struct {
+  word_table_t *table;
+  pthread_mutex_t *mutex;
+  approx_counter_t *approx;
+  sharded_table_t *sharded;
+} word_sink_t;
+
 // Global hash table and mutex
-word_count_t *word_counts = NULL;
-pthread_mutex_t count_mutex; // Thread arguments structure
+word_table_t word_counts;
+pthread_mutex_t count_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Thread arguments structure
 typedef struct {
   char *text;
-  int start;
-  int end;
+  size_t start;
+  size_t end;
   pthread_mutex_t *mutex;
+  word_table_t local_counts; // private table used when mutex is NULL
+  approx_counter_t *approx;  // counts go here instead when set
+  sharded_table_t *sharded;  // or here, shared by all threads
 } thread_args_t;
 
+// One slice (qsort) or pair of adjacent sorted runs (merge) of a parallel
+// sort: src[lo, mid) and src[mid, hi) are merged into dst[lo, hi)
+typedef struct {
+  word_count_t **src;
+  word_count_t **dst;
+  size_t lo;
+  size_t mid;
+  size_t hi;
+} sort_args_t;
+
+// Arguments for one merge step of the tree reduction
+typedef struct {
+  word_table_t *dst;
+  word_table_t *src;
+} merge_args_t;
+
+// Bytes of text per pool task; small enough that idle workers always find
+// something left to steal, large enough that task overhead stays negligible
+#define POOL_TASK_SIZE (256 * 1024)
+
+typedef struct {
+  size_t start;
+  size_t end;
+} count_task_t;
+
+// One pool worker: a deque of tasks (the owner pops from the tail, thieves
+// take from the head) and the private table it counts into. Padded so two
+// workers' locks never share a cache line.
+typedef struct {
+  pthread_mutex_t lock;
+  count_task_t *tasks;
+  size_t head;
+  size_t tail;
+  size_t cap;
+  word_table_t counts;
+  int id;
+  struct count_pool *pool;
+} __attribute__((aligned(64))) pool_worker_t;
+
+// Persistent work-stealing pool. Workers sleep on work_ready between jobs,
+// so counting a stream of documents reuses the same threads, for the counting
+// and for the tree reduction of their tables alike.
+typedef struct count_pool {
+  int num_workers;
+  pthread_t *threads;
+  pool_worker_t *workers;
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready;
+  pthread_cond_t work_done;
+  pthread_barrier_t merge_round; // separates the reduction's rounds
+  char *text;                // document of the current job
+  unsigned long generation;  // bumped once per job
+  int busy;                  // workers not yet out of tasks
+  int shutdown;
+} count_pool_t;
+
 // Function to normalize a word (convert to lowercase)
 void normalize_word(char *word) {
   for (int i = 0; word[i]; i++) {
     word[i] = tolower(word[i]);
   }
 }
-void add_word(char *word) {
-  word_count_t *entry;
+// 64-bit FNV-1a
+uint64_t hash_word(const char *word, size_t len) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)word[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+// Copy a word into the table's arena, starting a new block when the current
+// one is full. Blocks are never reallocated, so interned words do not move.
+char *intern_word(word_table_t *table, const char *word, size_t len) {
+  arena_block_t *block = table->arena;
 
-  HASH_FIND_STR(word_counts, word, entry);
-  if (entry == NULL) {
-    entry = (word_count_t *)malloc(sizeof(word_count_t));
-    strcpy(entry->word, word);
-    entry->count = 0;
-    HASH_ADD_STR(word_counts, word, entry);
+  if (block == NULL || block->cap - block->used < len + 1) {
+    size_t cap = len + 1 > ARENA_BLOCK_SIZE ? len + 1 : ARENA_BLOCK_SIZE;
+    block = malloc(sizeof(arena_block_t) + cap);
+    if (block == NULL) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    block->next = table->arena;
+    block->used = 0;
+    block->cap = cap;
+    table->arena = block;
   }
-  entry->count++;
+  char *copy = block->data + block->used;
+  memcpy(copy, word, len);
+  copy[len] = '\0';
+  block->used += len + 1;
+  return copy;
 }
-void add_word_counts_in_chunk(char *text, int start, int end,
-                              pthread_mutex_t *mutex) {
-  char word[50];
-  int word_idx = 0;
+// Double the slot array and re-place every entry by its cached hash
+void grow_word_table(word_table_t *table) {
+  size_t capacity =
+      table->capacity ? table->capacity * 2 : TABLE_MIN_CAPACITY;
+  word_count_t *slots = calloc(capacity, sizeof(word_count_t));
 
-  for (int i = start; i < end; i++) {
-    if (isalpha(text[i])) {
-      word[word_idx++] = text[i];
-    } else if (word_idx > 0) {
-      word[word_idx] = '\0';
-      normalize_word(word);
+  if (slots == NULL) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < table->capacity; i++) {
+    if (table->slots[i].word) {
+      size_t j = table->slots[i].hash & (capacity - 1);
+      while (slots[j].word)
+        j = (j + 1) & (capacity - 1);
+      slots[j] = table->slots[i];
+    }
+  }
+  free(table->slots);
+  table->slots = slots;
+  table->capacity = capacity;
+}
+// Add n to the count of word, inserting it first if it is new. The table is
+// kept at most 3/4 full so probe sequences stay short.
+word_count_t *word_table_add_hashed(word_table_t *table, const char *word,
+                                    size_t len, uint64_t hash, long n) {
+  if ((table->size + 1) * 4 > table->capacity * 3)
+    grow_word_table(table);
+
+  size_t mask = table->capacity - 1;
+  size_t i = hash & mask;
+  word_count_t *slot;
+
+  while ((slot = &table->slots[i])->word) {
+    if (slot->hash == hash && slot->len == len &&
+        memcmp(slot->word, word, len) == 0) {
+      slot->count += n;
+      return slot;
+    }
+    i = (i + 1) & mask;
+  }
+  slot->word = intern_word(table, word, len);
+  slot->hash = hash;
+  slot->len = len;
+  slot->count = n;
+  table->size++;
+  return slot;
+}
+word_count_t *word_table_add(word_table_t *table, const char *word,
+                             size_t len, long n) {
+  return word_table_add_hashed(table, word, len, hash_word(word, len), n);
+}
+word_count_t *word_table_find(word_table_t *table, const char *word,
+                              size_t len) {
+  if (table->capacity == 0)
+    return NULL;
+
+  uint64_t hash = hash_word(word, len);
+  size_t mask = table->capacity - 1;
+  for (size_t i = hash & mask; table->slots[i].word; i = (i + 1) & mask) {
+    word_count_t *slot = &table->slots[i];
+    if (slot->hash == hash && slot->len == len &&
+        memcmp(slot->word, word, len) == 0)
+      return slot;
+  }
+  return NULL;
+}
+// Release the slots and every arena block in one pass
+void free_word_table(word_table_t *table) {
+  arena_block_t *block = table->arena;
+  while (block) {
+    arena_block_t *next = block->next;
+    free(block);
+    block = next;
+  }
+  free(table->slots);
+  memset(table, 0, sizeof(word_table_t));
+}
+// Pointers to every entry, in slot order; the caller frees the array
+word_count_t **word_table_entries(word_table_t *table) {
+  word_count_t **entries = malloc((table->size + 1) * sizeof(word_count_t *));
+  size_t n = 0;
+
+  for (size_t i = 0; i < table->capacity; i++) {
+    if (table->slots[i].word)
+      entries[n++] = &table->slots[i];
+  }
+  return entries;
+}
+void add_word_to(word_table_t *table, char *word, size_t len) {
+  word_table_add(table, word, len, 1);
+}
+void add_word(char *word) { add_word_to(&word_counts, word, strlen(word)); }
+// Make room for extra more bytes plus a terminating NUL
+void word_buf_reserve(word_buf_t *buf, size_t extra) {
+  if (buf->len + extra + 1 > buf->cap) {
+    while (buf->len + extra + 1 > buf->cap)
+      buf->cap = buf->cap ? buf->cap * 2 : 64;
+    buf->data = realloc(buf->data, buf->cap);
+    if (buf->data == NULL) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+// Size the sketch for the classic Count-Min guarantee: width = e / eps and
+// depth = ln(1 / delta), so an estimate exceeds the true count by more than
+// eps * N with probability at most delta.
+void approx_init(approx_counter_t *approx, double eps, double delta,
+                 size_t capacity) {
+  size_t index_size = 1;
+
+  memset(approx, 0, sizeof(approx_counter_t));
+  approx->eps = eps;
+  approx->delta = delta;
+  approx->width = (size_t)(2.718281828459045 / eps) + 1;
+  for (double p = 1.0; p > delta; p /= 2.718281828459045)
+    approx->depth++;
+  if (approx->depth == 0)
+    approx->depth = 1;
+  approx->capacity = capacity;
+  while (index_size < 2 * capacity)
+    index_size *= 2;
+  approx->index_mask = index_size - 1;
+
+  approx->sketch = calloc(approx->width * approx->depth, sizeof(long));
+  approx->hitters = calloc(capacity + 1, sizeof(heavy_hitter_t));
+  approx->heap = calloc(capacity + 1, sizeof(uint32_t));
+  approx->index = malloc(index_size * sizeof(int32_t));
+  if (!approx->sketch || !approx->hitters || !approx->heap || !approx->index) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  memset(approx->index, -1, index_size * sizeof(int32_t));
+}
+void approx_free(approx_counter_t *approx) {
+  free(approx->sketch);
+  free(approx->hitters);
+  free(approx->heap);
+  free(approx->index);
+  memset(approx, 0, sizeof(approx_counter_t));
+}
+// splitmix64 finalizer, used to derive the second sketch hash
+uint64_t mix_hash(uint64_t h) {
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+// Row d uses column (h1 + d * h2) mod width (Kirsch-Mitzenmacher)
+long *sketch_cell(approx_counter_t *approx, uint64_t hash, size_t d) {
+  uint64_t h2 = mix_hash(hash) | 1;
+  return &approx->sketch[d * approx->width + (hash + d * h2) % approx->width];
+}
+long sketch_estimate(approx_counter_t *approx, uint64_t hash) {
+  long min = *sketch_cell(approx, hash, 0);
+  for (size_t d = 1; d < approx->depth; d++) {
+    long cell = *sketch_cell(approx, hash, d);
+    min = cell < min ? cell : min;
+  }
+  return min;
+}
+int32_t find_hitter(approx_counter_t *approx, const char *word, size_t len,
+                    uint64_t hash) {
+  for (size_t i = hash & approx->index_mask; approx->index[i] != -1;
+       i = (i + 1) & approx->index_mask) {
+    heavy_hitter_t *h = &approx->hitters[approx->index[i]];
+    if (h->hash == hash && h->len == len && memcmp(h->word, word, len) == 0)
+      return approx->index[i];
+  }
+  return -1;
+}
+void index_hitter(approx_counter_t *approx, uint32_t id) {
+  size_t i = approx->hitters[id].hash & approx->index_mask;
+  while (approx->index[i] != -1)
+    i = (i + 1) & approx->index_mask;
+  approx->index[i] = id;
+}
+// Remove a hitter from the index, shifting later entries of its probe run
+// back so lookups never stop early at the hole
+void unindex_hitter(approx_counter_t *approx, uint32_t id) {
+  size_t mask = approx->index_mask;
+  size_t i = approx->hitters[id].hash & mask;
+
+  while (approx->index[i] != (int32_t)id)
+    i = (i + 1) & mask;
+  approx->index[i] = -1;
+  for (size_t j = (i + 1) & mask; approx->index[j] != -1; j = (j + 1) & mask) {
+    size_t home = approx->hitters[approx->index[j]].hash & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      approx->index[i] = approx->index[j];
+      approx->index[j] = -1;
+      i = j;
+    }
+  }
+}
+void swap_heap(approx_counter_t *approx, size_t a, size_t b) {
+  uint32_t tmp = approx->heap[a];
+  approx->heap[a] = approx->heap[b];
+  approx->heap[b] = tmp;
+  approx->hitters[approx->heap[a]].heap_pos = a;
+  approx->hitters[approx->heap[b]].heap_pos = b;
+}
+long hitter_count(approx_counter_t *approx, size_t heap_pos) {
+  return approx->hitters[approx->heap[heap_pos]].count;
+}
+void hitter_sift_up(approx_counter_t *approx, size_t i) {
+  while (i > 0 && hitter_count(approx, (i - 1) / 2) > hitter_count(approx, i)) {
+    swap_heap(approx, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+void hitter_sift_down(approx_counter_t *approx, size_t i) {
+  for (;;) {
+    size_t min = i, left = 2 * i + 1, right = 2 * i + 2;
+    if (left < approx->size &&
+        hitter_count(approx, left) < hitter_count(approx, min))
+      min = left;
+    if (right < approx->size &&
+        hitter_count(approx, right) < hitter_count(approx, min))
+      min = right;
+    if (min == i)
+      return;
+    swap_heap(approx, i, min);
+    i = min;
+  }
+}
+// Start tracking a word with the given count and error bound
+void push_hitter(approx_counter_t *approx, const char *word, size_t len,
+                 uint64_t hash, long count, long error) {
+  uint32_t id = approx->size++;
+  heavy_hitter_t *h = &approx->hitters[id];
+
+  memcpy(h->word, word, len);
+  h->word[len] = '\0';
+  h->len = len;
+  h->hash = hash;
+  h->count = count;
+  h->error = error;
+  h->heap_pos = id;
+  approx->heap[id] = id;
+  index_hitter(approx, id);
+  hitter_sift_up(approx, id);
+}
+// Space-Saving update: a tracked word is incremented; an untracked word
+// takes over the least counted entry, inheriting its count as the error.
+void approx_add(approx_counter_t *approx, const char *word, size_t len) {
+  if (len > APPROX_MAX_WORD_LEN - 1)
+    len = APPROX_MAX_WORD_LEN - 1;
+
+  uint64_t hash = hash_word(word, len);
+  int32_t id = find_hitter(approx, word, len, hash);
+
+  approx->total++;
+  for (size_t d = 0; d < approx->depth; d++)
+    (*sketch_cell(approx, hash, d))++;
+
+  if (id >= 0) {
+    approx->hitters[id].count++;
+    hitter_sift_down(approx, approx->hitters[id].heap_pos);
+  } else if (approx->size < approx->capacity) {
+    push_hitter(approx, word, len, hash, 1, 0);
+  } else if (approx->capacity > 0) {
+    uint32_t victim = approx->heap[0];
+    heavy_hitter_t *h = &approx->hitters[victim];
+    unindex_hitter(approx, victim);
+    memcpy(h->word, word, len);
+    h->word[len] = '\0';
+    h->len = len;
+    h->hash = hash;
+    h->error = h->count;
+    h->count++;
+    index_hitter(approx, victim);
+    hitter_sift_down(approx, 0);
+  }
+}
+// Count of the least counted entry of a full list, 0 otherwise: an
+// untracked word can have occurred at most this often
+long approx_floor(approx_counter_t *approx) {
+  if (approx->size < approx->capacity || approx->size == 0)
+    return 0;
+  return hitter_count(approx, 0);
+}
+int hitter_sort(const void *a, const void *b) {
+  const heavy_hitter_t *x = a, *y = b;
+  if (x->count != y->count)
+    return x->count < y->count ? 1 : -1;
+  return strcmp(x->word, y->word);
+}
+// Fold src into dst and free src. Both must have been initialised with the
+// same eps, delta and capacity. Sketch rows add cell by cell; the two
+// Space-Saving lists merge as mergeable summaries (a word missing from one
+// list is charged that list's floor), keeping the capacity heaviest.
+void approx_merge(approx_counter_t *dst, approx_counter_t *src) {
+  size_t num_cells = dst->width * dst->depth;
+  heavy_hitter_t *merged =
+      malloc((dst->size + src->size + 1) * sizeof(heavy_hitter_t));
+  long dst_floor = approx_floor(dst), src_floor = approx_floor(src);
+  size_t n = 0;
+
+  for (size_t i = 0; i < num_cells; i++)
+    dst->sketch[i] += src->sketch[i];
+  dst->total += src->total;
+
+  for (size_t i = 0; i < dst->size; i++) {
+    heavy_hitter_t *h = &dst->hitters[i];
+    int32_t id = find_hitter(src, h->word, h->len, h->hash);
+    merged[n] = *h;
+    merged[n].count += id >= 0 ? src->hitters[id].count : src_floor;
+    merged[n].error += id >= 0 ? src->hitters[id].error : src_floor;
+    n++;
+  }
+  for (size_t i = 0; i < src->size; i++) {
+    heavy_hitter_t *h = &src->hitters[i];
+    if (find_hitter(dst, h->word, h->len, h->hash) < 0) {
+      merged[n] = *h;
+      merged[n].count += dst_floor;
+      merged[n].error += dst_floor;
+      n++;
+    }
+  }
+  qsort(merged, n, sizeof(heavy_hitter_t), hitter_sort);
+
+  dst->size = 0;
+  memset(dst->index, -1, (dst->index_mask + 1) * sizeof(int32_t));
+  for (size_t i = 0; i < n && i < dst->capacity; i++) {
+    push_hitter(dst, merged[i].word, merged[i].len, merged[i].hash,
+                merged[i].count, merged[i].error);
+  }
+  free(merged);
+  approx_free(src);
+}
+void sharded_init(sharded_table_t *map, int num_shards) {
+  map->num_shards = num_shards;
+  map->shards = aligned_alloc(64, num_shards * sizeof(word_shard_t));
+  memset(map->shards, 0, num_shards * sizeof(word_shard_t));
+  for (int i = 0; i < num_shards; i++)
+    pthread_mutex_init(&map->shards[i].lock, NULL);
+}
+void sharded_free(sharded_table_t *map) {
+  for (int i = 0; i < map->num_shards; i++) {
+    pthread_mutex_destroy(&map->shards[i].lock);
+    free_word_table(&map->shards[i].table);
+  }
+  free(map->shards);
+  map->shards = NULL;
+}
+// The slot index uses the low hash bits, so the shard takes the high ones;
+// the hash is computed once and reused inside the shard
+void sharded_add(sharded_table_t *map, const char *word, size_t len) {
+  uint64_t hash = hash_word(word, len);
+  word_shard_t *shard = &map->shards[(hash >> 40) & (map->num_shards - 1)];
+
+  pthread_mutex_lock(&shard->lock);
+  word_table_add_hashed(&shard->table, word, len, hash, 1);
+  pthread_mutex_unlock(&shard->lock);
+}
+// Lock the table if it is shared and count one finished word
+void flush_word(word_buf_t *word, word_sink_t *sink) {
+  if (sink->approx) {
+    approx_add(sink->approx, word->data, word->len);
+  } else if (sink->sharded) {
+    sharded_add(sink->sharded, word->data, word->len);
+  } else {
+    if (sink->mutex)
+      pthread_mutex_lock(sink->mutex);
+    add_word_to(sink->table, word->data, word->len);
+    if (sink->mutex)
+      pthread_mutex_unlock(sink->mutex);
+  }
+  word->len = 0;
+}
+// Count the words in text[start, end) into table. The mutex is only taken
+// when the table is shared; per-thread tables pass NULL and never lock.
+void add_word_counts_in_chunk_scalar(char *text, size_t start, size_t end,
+                                     word_sink_t *sink) {
+  word_buf_t word = {NULL, 0, 0};
+
+  for (size_t i = start; i < end; i++) {
+    if (isalpha((unsigned char)text[i])) {
+      word_buf_reserve(&word, 1);
+      word.data[word.len++] = text[i];
+    } else if (word.len > 0) {
+      word.data[word.len] = '\0';
+      normalize_word(word.data);
 
       // TASK 4: Lock mutex before accessing shared hash table
-      pthread_mutex_lock(mutex);
-      add_word(word);
-      pthread_mutex_unlock(mutex);
+      flush_word(&word, sink);
+    }
+  }
+  if (word.len > 0) {
+    word.data[word.len] = '\0';
+    normalize_word(word.data);
+    flush_word(&word, sink);
+  }
+  free(word.data);
+}
+#ifdef HAVE_X86_SIMD
+// Walk one block of already-lowercased bytes using its letter bitmask (bit i
+// set when byte i is a letter). Whole runs of letters are copied at once and
+// a word is flushed at the first non-letter after it; a run that reaches the
+// end of the block stays in word[] and continues in the next block.
+void scan_block(const char *lowered, uint32_t mask, int width,
+                word_buf_t *word, word_sink_t *sink) {
+  int pos = 0;
 
-      word_idx = 0;
+  while (pos < width) {
+    uint64_t rest = (uint64_t)mask >> pos;
+    if (rest & 1) {
+      int run = __builtin_ctzll(~rest);
+      word_buf_reserve(word, run);
+      memcpy(word->data + word->len, lowered + pos, run);
+      word->len += run;
+      pos += run;
+    } else {
+      if (word->len > 0) {
+        flush_word(word, sink);
+      }
+      if (rest == 0)
+        break;
+      pos += __builtin_ctzll(rest);
     }
   }
-  if (word_idx > 0) {
-    word[word_idx] = '\0';
-    normalize_word(word);
+}
+// Letters are the ASCII a-z/A-Z that isalpha accepts in the C locale. OR-ing
+// 0x20 folds upper case onto lower case, and adding 128 - 'a' moves a..z to
+// the bottom of the signed range, so one signed compare classifies a byte.
+__attribute__((target("sse2"))) void
+add_word_counts_in_chunk_sse2(char *text, size_t start, size_t end,
+                              word_sink_t *sink) {
+  const __m128i case_bit = _mm_set1_epi8(0x20);
+  const __m128i bias = _mm_set1_epi8((char)(128 - 'a'));
+  const __m128i limit = _mm_set1_epi8((char)(-128 + 26));
+  word_buf_t word = {NULL, 0, 0};
+  char lowered[16];
+  char tail[16];
+  size_t i = start;
 
-    pthread_mutex_lock(mutex);
-    add_word(word);
-    pthread_mutex_unlock(mutex);
+  while (i < end) {
+    __m128i v;
+    if (end - i >= 16) {
+      v = _mm_loadu_si128((const __m128i *)(text + i));
+    } else {
+      memset(tail, 0, sizeof(tail));
+      memcpy(tail, text + i, end - i);
+      v = _mm_loadu_si128((const __m128i *)tail);
+    }
+    __m128i folded = _mm_or_si128(v, case_bit);
+    __m128i is_letter = _mm_cmplt_epi8(_mm_add_epi8(folded, bias), limit);
+    __m128i lower = _mm_or_si128(v, _mm_and_si128(is_letter, case_bit));
+    _mm_storeu_si128((__m128i *)lowered, lower);
+    scan_block(lowered, (uint32_t)_mm_movemask_epi8(is_letter), 16, &word,
+               sink);
+    i += 16;
   }
+  if (word.len > 0)
+    flush_word(&word, sink);
+  free(word.data);
+}
+__attribute__((target("avx2"))) void
+add_word_counts_in_chunk_avx2(char *text, size_t start, size_t end,
+                              word_sink_t *sink) {
+  const __m256i case_bit = _mm256_set1_epi8(0x20);
+  const __m256i bias = _mm256_set1_epi8((char)(128 - 'a'));
+  const __m256i limit = _mm256_set1_epi8((char)(-128 + 26));
+  word_buf_t word = {NULL, 0, 0};
+  char lowered[32];
+  char tail[32];
+  size_t i = start;
+
+  while (i < end) {
+    __m256i v;
+    if (end - i >= 32) {
+      v = _mm256_loadu_si256((const __m256i *)(text + i));
+    } else {
+      memset(tail, 0, sizeof(tail));
+      memcpy(tail, text + i, end - i);
+      v = _mm256_loadu_si256((const __m256i *)tail);
+    }
+    __m256i folded = _mm256_or_si256(v, case_bit);
+    __m256i is_letter =
+        _mm256_cmpgt_epi8(limit, _mm256_add_epi8(folded, bias));
+    __m256i lower = _mm256_or_si256(v, _mm256_and_si256(is_letter, case_bit));
+    _mm256_storeu_si256((__m256i *)lowered, lower);
+    scan_block(lowered, (uint32_t)_mm256_movemask_epi8(is_letter), 32, &word,
+               sink);
+    i += 32;
+  }
+  if (word.len > 0)
+    flush_word(&word, sink);
+  free(word.data);
+}
+#endif
+
+typedef void (*chunk_counter_fn)(char *text, size_t start, size_t end,
+                                 word_sink_t *sink);
+
+// Tokenizer used by add_word_counts_in_chunk; picked once from the CPU
+// features unless main already forced one with -k
+chunk_counter_fn chunk_counter = NULL;
+pthread_once_t chunk_counter_once = PTHREAD_ONCE_INIT;
+
+// Look up a tokenizer by name ("auto" picks the widest one the CPU
+// supports). Returns NULL for unknown names or kernels the CPU lacks.
+chunk_counter_fn find_chunk_counter(const char *name) {
+  int is_auto = strcmp(name, "auto") == 0;
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if ((is_auto || strcmp(name, "avx2") == 0) &&
+      __builtin_cpu_supports("avx2"))
+    return add_word_counts_in_chunk_avx2;
+  if ((is_auto || strcmp(name, "sse2") == 0) &&
+      __builtin_cpu_supports("sse2"))
+    return add_word_counts_in_chunk_sse2;
+#endif
+  if (is_auto || strcmp(name, "scalar") == 0)
+    return add_word_counts_in_chunk_scalar;
+  return NULL;
+}
+void pick_chunk_counter(void) {
+  if (chunk_counter == NULL)
+    chunk_counter = find_chunk_counter("auto");
+}
+void add_word_counts_in_chunk(char *text, size_t start, size_t end,
+                              word_sink_t *sink) {
+  pthread_once(&chunk_counter_once, pick_chunk_counter);
+  chunk_counter(text, start, end, sink);
 }
 void *counter_thread_func(void *args) {
   thread_args_t *thread_args = (thread_args_t *)args;
+  word_sink_t sink = {&thread_args->local_counts, NULL, thread_args->approx,
+                      thread_args->sharded};
+
+  if (thread_args->mutex) {
+    sink.table = &word_counts;
+    sink.mutex = thread_args->mutex;
+  }
   add_word_counts_in_chunk(thread_args->text, thread_args->start,
-                           thread_args->end, thread_args->mutex);
+                           thread_args->end, &sink);
   return NULL;
 }
-thread_args_t *pack_args(char *text, int start, int end,
+thread_args_t *pack_args(char *text, size_t start, size_t end,
                          pthread_mutex_t *mutex) {
   thread_args_t *args = (thread_args_t *)malloc(sizeof(thread_args_t));
   args->text = text;
   args->start = start;
   args->end = end;
   args->mutex = mutex;
+  memset(&args->local_counts, 0, sizeof(word_table_t));
+  args->approx = NULL;
+  args->sharded = NULL;
   return args;
 }
-void count_words_seq(char *text, int text_len) {
-  add_word_counts_in_chunk(text, 0, text_len, NULL);
+// Add every entry of src into dst, summing counts of words present in both,
+// then free src. The cached hashes are reused, so no word is hashed twice.
+void merge_word_counts(word_table_t *dst, word_table_t *src) {
+  for (size_t i = 0; i < src->capacity; i++) {
+    word_count_t *entry = &src->slots[i];
+    if (entry->word) {
+      word_table_add_hashed(dst, entry->word, entry->len, entry->hash,
+                            entry->count);
+    }
+  }
+  free_word_table(src);
+}
+void *merge_thread_func(void *args) {
+  merge_args_t *merge_args = (merge_args_t *)args;
+  merge_word_counts(merge_args->dst, merge_args->src);
+  return NULL;
+}
+// Pairwise tree reduction: in round r, table i absorbs table i + 2^r, so n
+// tables are combined in ceil(log2(n)) rounds with the merges of each round
+// running in parallel. The result ends up in tables[0].
+void reduce_word_counts(word_table_t *tables, int num_tables) {
+  pthread_t threads[num_tables];
+  merge_args_t merge_args[num_tables];
+
+  for (int stride = 1; stride < num_tables; stride *= 2) {
+    int num_merges = 0;
+    for (int i = 0; i + stride < num_tables; i += 2 * stride) {
+      merge_args[num_merges].dst = &tables[i];
+      merge_args[num_merges].src = &tables[i + stride];
+      pthread_create(&threads[num_merges], NULL, merge_thread_func,
+                     &merge_args[num_merges]);
+      num_merges++;
+    }
+    for (int i = 0; i < num_merges; i++) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+}
+// Split text into num_chunks ranges [bounds[i], bounds[i + 1]). Each border
+// starts at an even byte offset and is then pushed forward past any letters,
+// so no word straddles two chunks.
+void split_chunks(char *text, size_t text_len, size_t num_chunks,
+                  size_t *bounds) {
+  size_t chunk_size = text_len / num_chunks;
+
+  bounds[0] = 0;
+  for (size_t i = 1; i < num_chunks; i++) {
+    size_t pos = i * chunk_size;
+    if (pos < bounds[i - 1]) {
+      pos = bounds[i - 1];
+    }
+    while (pos < text_len && isalpha((unsigned char)text[pos])) {
+      pos++;
+    }
+    bounds[i] = pos;
+  }
+  bounds[num_chunks] = text_len;
+}
+void count_words_seq(char *text, size_t text_len) {
+  word_sink_t sink = {&word_counts, NULL, NULL, NULL};
+  add_word_counts_in_chunk(text, 0, text_len, &sink);
 }
-void count_words_parallel(char *text, int text_len, int num_threads) {
+void count_words_parallel(char *text, size_t text_len, int num_threads) {
   pthread_t threads[num_threads];
   thread_args_t *threads_args[num_threads];
+  size_t bounds[num_threads + 1];
 
-  // TASK 2: Initialize the mutex
-  pthread_mutex_init(&count_mutex, NULL);
-
-  int chunk_size = text_len / num_threads;
+  split_chunks(text, text_len, num_threads, bounds);
 
   // TASK 2: Create threads
   for (int i = 0; i < num_threads; i++) {
-    int start = i * chunk_size;
-    int end = (i == num_threads - 1) ? text_len : (i + 1) * chunk_size;
-
     // Initialize thread arguments
-    threads_args[i] =
-        pack_args(text, start, end, &count_mutex); // Launch thread
+    threads_args[i] = pack_args(text, bounds[i], bounds[i + 1],
+                                &count_mutex); // Launch thread
     pthread_create(&threads[i], NULL, counter_thread_func, threads_args[i]);
   }
 
@@ -116,50 +868,1116 @@ void count_words_parallel(char *text, int text_len, int num_threads) {
   for (int i = 0; i < num_threads; i++) {
     free(threads_args[i]);
   }
+}
+// Lock-free variant of count_words_parallel: every thread counts into its own
+// table, and the tables are folded together after the join.
+void count_words_parallel_local(char *text, size_t text_len,
+                                int num_threads) {
+  pthread_t threads[num_threads];
+  thread_args_t *threads_args[num_threads];
+  word_table_t tables[num_threads + 1];
+  size_t bounds[num_threads + 1];
+
+  split_chunks(text, text_len, num_threads, bounds);
+
+  for (int i = 0; i < num_threads; i++) {
+    threads_args[i] = pack_args(text, bounds[i], bounds[i + 1], NULL);
+    pthread_create(&threads[i], NULL, counter_thread_func, threads_args[i]);
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  // Fold in any counts already in the global table so repeated calls add up
+  for (int i = 0; i < num_threads; i++) {
+    tables[i] = threads_args[i]->local_counts;
+    free(threads_args[i]);
+  }
+  tables[num_threads] = word_counts;
+  reduce_word_counts(tables, num_threads + 1);
+  word_counts = tables[0];
+}
+// Take a task from the tail of our own deque
+int pop_task(pool_worker_t *worker, count_task_t *task) {
+  int found = 0;
+
+  pthread_mutex_lock(&worker->lock);
+  if (worker->tail > worker->head) {
+    *task = worker->tasks[--worker->tail];
+    found = 1;
+  }
+  pthread_mutex_unlock(&worker->lock);
+  return found;
+}
+// Take the oldest task of another worker, trying each victim once
+int steal_task(pool_worker_t *thief, count_task_t *task) {
+  count_pool_t *pool = thief->pool;
+
+  for (int i = 1; i < pool->num_workers; i++) {
+    pool_worker_t *victim = &pool->workers[(thief->id + i) % pool->num_workers];
+    pthread_mutex_lock(&victim->lock);
+    if (victim->tail > victim->head) {
+      *task = victim->tasks[victim->head++];
+      pthread_mutex_unlock(&victim->lock);
+      return 1;
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+  return 0;
+}
+void *pool_worker_func(void *args) {
+  pool_worker_t *worker = (pool_worker_t *)args;
+  count_pool_t *pool = worker->pool;
+  unsigned long seen = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->generation == seen && !pool->shutdown)
+      pthread_cond_wait(&pool->work_ready, &pool->lock);
+    if (pool->shutdown) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    seen = pool->generation;
+    char *text = pool->text;
+    pthread_mutex_unlock(&pool->lock);
+
+    // All tasks are queued before the job starts, so once neither our deque
+    // nor any victim has work left, this worker is done with the job
+    word_sink_t sink = {&worker->counts, NULL, NULL, NULL};
+    count_task_t task;
+    while (pop_task(worker, &task) || steal_task(worker, &task)) {
+      add_word_counts_in_chunk(text, task.start, task.end, &sink);
+    }
+
+    // Second phase: the same pairwise tree reduction as reduce_word_counts,
+    // with every round's merges run by the workers themselves. Worker 0
+    // ends up with all the counts.
+    for (int stride = 1; stride < pool->num_workers; stride *= 2) {
+      pthread_barrier_wait(&pool->merge_round);
+      if (worker->id % (2 * stride) == 0 &&
+          worker->id + stride < pool->num_workers) {
+        merge_word_counts(&worker->counts,
+                          &pool->workers[worker->id + stride].counts);
+      }
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->busy == 0)
+      pthread_cond_signal(&pool->work_done);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+count_pool_t *count_pool_create(int num_workers) {
+  count_pool_t *pool = calloc(1, sizeof(count_pool_t));
+
+  pool->num_workers = num_workers;
+  pool->threads = malloc(num_workers * sizeof(pthread_t));
+  pool->workers = aligned_alloc(64, num_workers * sizeof(pool_worker_t));
+  memset(pool->workers, 0, num_workers * sizeof(pool_worker_t));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_ready, NULL);
+  pthread_cond_init(&pool->work_done, NULL);
+  pthread_barrier_init(&pool->merge_round, NULL, num_workers);
+  for (int i = 0; i < num_workers; i++) {
+    pthread_mutex_init(&pool->workers[i].lock, NULL);
+    pool->workers[i].id = i;
+    pool->workers[i].pool = pool;
+    pthread_create(&pool->threads[i], NULL, pool_worker_func,
+                   &pool->workers[i]);
+  }
+  return pool;
+}
+void count_pool_destroy(count_pool_t *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->num_workers; i++) {
+    pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->workers[i].lock);
+    free(pool->workers[i].tasks);
+    free_word_table(&pool->workers[i].counts);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work_ready);
+  pthread_cond_destroy(&pool->work_done);
+  pthread_barrier_destroy(&pool->merge_round);
+  free(pool->workers);
+  free(pool->threads);
+  free(pool);
+}
+// Count one document on the pool. The text is cut into word-aligned tasks of
+// about POOL_TASK_SIZE bytes, dealt out to the deques in contiguous runs;
+// workers that run dry steal from the others. The workers then tree-reduce
+// their tables, and the result is folded into word_counts.
+void count_pool_count(count_pool_t *pool, char *text, size_t text_len) {
+  int num_workers = pool->num_workers;
+  size_t num_tasks = text_len / POOL_TASK_SIZE + 1;
+  size_t *bounds = malloc((num_tasks + 1) * sizeof(size_t));
+
+  split_chunks(text, text_len, num_tasks, bounds);
+  for (int w = 0; w < num_workers; w++) {
+    pool_worker_t *worker = &pool->workers[w];
+    size_t first = num_tasks * w / num_workers;
+    size_t last = num_tasks * (w + 1) / num_workers;
+
+    if (worker->cap < last - first) {
+      worker->cap = last - first;
+      worker->tasks =
+          realloc(worker->tasks, worker->cap * sizeof(count_task_t));
+    }
+    // Pushed back to front so the owner pops them in text order
+    worker->head = 0;
+    worker->tail = 0;
+    for (size_t t = last; t-- > first;) {
+      worker->tasks[worker->tail++] = (count_task_t){bounds[t], bounds[t + 1]};
+    }
+  }
+  free(bounds);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->text = text;
+  pool->busy = num_workers;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->work_ready);
+  while (pool->busy > 0)
+    pthread_cond_wait(&pool->work_done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+
+  // Counts already in word_counts add up with repeated calls
+  if (word_counts.size == 0) {
+    free_word_table(&word_counts);
+    word_counts = pool->workers[0].counts;
+  } else {
+    merge_word_counts(&word_counts, &pool->workers[0].counts);
+  }
+  memset(&pool->workers[0].counts, 0, sizeof(word_table_t));
+}
+// All threads count straight into one lock-striped map. Shards hold
+// disjoint words, so afterwards they fold into word_counts without any
+// collisions between them.
+void count_words_sharded(char *text, size_t text_len, int num_threads,
+                         int num_shards) {
+  pthread_t threads[num_threads];
+  thread_args_t *threads_args[num_threads];
+  size_t bounds[num_threads + 1];
+  word_table_t tables[num_shards + 1];
+  sharded_table_t map;
+
+  sharded_init(&map, num_shards);
+  split_chunks(text, text_len, num_threads, bounds);
+
+  for (int i = 0; i < num_threads; i++) {
+    threads_args[i] = pack_args(text, bounds[i], bounds[i + 1], NULL);
+    threads_args[i]->sharded = &map;
+    pthread_create(&threads[i], NULL, counter_thread_func, threads_args[i]);
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+    free(threads_args[i]);
+  }
+
+  for (int i = 0; i < num_shards; i++) {
+    tables[i] = map.shards[i].table;
+    memset(&map.shards[i].table, 0, sizeof(word_table_t));
+  }
+  tables[num_shards] = word_counts;
+  reduce_word_counts(tables, num_shards + 1);
+  word_counts = tables[0];
+  sharded_free(&map);
+}
+// Bounded-memory variant: each thread feeds its own approximate counter set
+// up like result, and the counters are folded into result after the join.
+void count_words_approx(char *text, size_t text_len, int num_threads,
+                        approx_counter_t *result) {
+  pthread_t threads[num_threads];
+  thread_args_t *threads_args[num_threads];
+  approx_counter_t counters[num_threads];
+  size_t bounds[num_threads + 1];
+
+  split_chunks(text, text_len, num_threads, bounds);
+
+  for (int i = 0; i < num_threads; i++) {
+    approx_init(&counters[i], result->eps, result->delta, result->capacity);
+    threads_args[i] = pack_args(text, bounds[i], bounds[i + 1], NULL);
+    threads_args[i]->approx = &counters[i];
+    pthread_create(&threads[i], NULL, counter_thread_func, threads_args[i]);
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+    approx_merge(result, &counters[i]);
+    free(threads_args[i]);
+  }
+}
+// Comparison function for sorting
+int word_count_sort(const void *a, const void *b) {
+  return strcmp((*(word_count_t **)a)->word, (*(word_count_t **)b)->word);
+}
+void *sort_thread_func(void *args) {
+  sort_args_t *sort_args = (sort_args_t *)args;
+  qsort(sort_args->src + sort_args->lo, sort_args->hi - sort_args->lo,
+        sizeof(word_count_t *), word_count_sort);
+  return NULL;
+}
+void *merge_runs_thread_func(void *args) {
+  sort_args_t *a = (sort_args_t *)args;
+  size_t i = a->lo, j = a->mid, k = a->lo;
 
-  // Destroy mutex
-  pthread_mutex_destroy(&count_mutex);
-}/ Comparison function for sorting
-int word_count_sort(word_count_t *a, word_count_t *b) {
-  return strcmp(a->word, b->word);
+  while (i < a->mid && j < a->hi) {
+    if (word_count_sort(&a->src[j], &a->src[i]) < 0)
+      a->dst[k++] = a->src[j++];
+    else
+      a->dst[k++] = a->src[i++];
+  }
+  while (i < a->mid)
+    a->dst[k++] = a->src[i++];
+  while (j < a->hi)
+    a->dst[k++] = a->src[j++];
+  return NULL;
+}
+// Sort entries by word: every thread qsorts one slice, then sorted runs are
+// merged pairwise in parallel rounds, ping-ponging between entries and a
+// scratch array.
+void sort_entries_parallel(word_count_t **entries, size_t n,
+                           int num_threads) {
+  pthread_t threads[num_threads];
+  sort_args_t sort_args[num_threads];
+  size_t bounds[num_threads + 1];
+  word_count_t **src = entries;
+  word_count_t **dst = malloc((n + 1) * sizeof(word_count_t *));
+  word_count_t **scratch = dst;
+
+  for (int i = 0; i <= num_threads; i++) {
+    bounds[i] = n * i / num_threads;
+  }
+  for (int i = 0; i < num_threads; i++) {
+    sort_args[i] = (sort_args_t){src, NULL, bounds[i], 0, bounds[i + 1]};
+    pthread_create(&threads[i], NULL, sort_thread_func, &sort_args[i]);
+  }
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  for (int width = 1; width < num_threads; width *= 2) {
+    int num_merges = 0;
+    for (int i = 0; i < num_threads; i += 2 * width) {
+      int mid = i + width < num_threads ? i + width : num_threads;
+      int hi = i + 2 * width < num_threads ? i + 2 * width : num_threads;
+      sort_args[num_merges] =
+          (sort_args_t){src, dst, bounds[i], bounds[mid], bounds[hi]};
+      pthread_create(&threads[num_merges], NULL, merge_runs_thread_func,
+                     &sort_args[num_merges]);
+      num_merges++;
+    }
+    for (int i = 0; i < num_merges; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    word_count_t **tmp = src;
+    src = dst;
+    dst = tmp;
+  }
+  if (src != entries) {
+    memcpy(entries, src, n * sizeof(word_count_t *));
+  }
+  free(scratch);
 }
 
 // Print the word counts
-void print_word_counts() {
-  word_count_t *entry, *tmp;
+void print_word_counts(int num_threads) {
+  word_count_t **entries = word_table_entries(&word_counts);
+
+  // TASK 1: Sort the hash table before printing
+  sort_entries_parallel(entries, word_counts.size, num_threads);
 
   printf("%-30s %s\n", "Word", "Count");
-  HASH_ITER(hh, word_counts, entry, tmp) {
-    printf("%-30s %d\n", entry->word, entry->count);
+  for (size_t i = 0; i < word_counts.size; i++) {
+    printf("%-30s %ld\n", entries[i]->word, entries[i]->count);
   }
+  free(entries);
 }
-void cleanup() {
-  word_count_t *entry, *tmp;
-  HASH_ITER(hh, word_counts, entry, tmp) {
-    HASH_DEL(word_counts, entry);
-    free(entry);
+// Heap order for top-K: a ranks below b when it is less frequent, or equally
+// frequent and later in alphabetical order
+int less_frequent(word_count_t *a, word_count_t *b) {
+  if (a->count != b->count)
+    return a->count < b->count;
+  return strcmp(a->word, b->word) > 0;
+}
+void sift_down(word_count_t **heap, size_t n, size_t i) {
+  for (;;) {
+    size_t min = i, left = 2 * i + 1, right = 2 * i + 2;
+    if (left < n && less_frequent(heap[left], heap[min]))
+      min = left;
+    if (right < n && less_frequent(heap[right], heap[min]))
+      min = right;
+    if (min == i)
+      return;
+    word_count_t *tmp = heap[i];
+    heap[i] = heap[min];
+    heap[min] = tmp;
+    i = min;
   }
 }
+// The k most frequent words, most frequent first, in O(n log k) time and O(k)
+// extra space: a min-heap holds the best k seen so far and its root, the
+// weakest of them, is replaced whenever a more frequent word turns up.
+// Returns a malloc'd array and stores its length in *num_out.
+word_count_t **top_k_words(word_table_t *table, size_t k, size_t *num_out) {
+  word_count_t **heap;
+  size_t n = 0;
+
+  // k comes from the command line; there are never more than size answers
+  if (k > table->size)
+    k = table->size;
+  heap = malloc((k + 1) * sizeof(word_count_t *));
+  if (heap == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t i = 0; i < table->capacity && k > 0; i++) {
+    word_count_t *entry = &table->slots[i];
+    if (entry->word == NULL)
+      continue;
+    if (n < k) {
+      heap[n++] = entry;
+      if (n == k) {
+        for (size_t j = k / 2; j-- > 0;)
+          sift_down(heap, n, j);
+      }
+    } else if (less_frequent(heap[0], entry)) {
+      heap[0] = entry;
+      sift_down(heap, n, 0);
+    }
+  }
+  if (n < k) {
+    for (size_t j = n / 2; j-- > 0;)
+      sift_down(heap, n, j);
+  }
+  // Heap sort in place: popping the minimum to the back leaves the array in
+  // descending order of frequency
+  for (size_t end = n; end > 1; end--) {
+    word_count_t *tmp = heap[0];
+    heap[0] = heap[end - 1];
+    heap[end - 1] = tmp;
+    sift_down(heap, end - 1, 0);
+  }
+  *num_out = n;
+  return heap;
+}
+void print_top_k(size_t k) {
+  size_t n;
+  word_count_t **top = top_k_words(&word_counts, k, &n);
+
+  printf("%-30s %s\n", "Word", "Count");
+  for (size_t i = 0; i < n; i++) {
+    printf("%-30s %ld\n", top[i]->word, top[i]->count);
+  }
+  free(top);
+}
+void cleanup() { free_word_table(&word_counts); }
+
+// Print the k heaviest words with both error bounds: the Space-Saving count
+// overestimates by at most Error, and the Count-Min estimate overestimates
+// by at most eps * N except with probability delta.
+void print_approx_counts(approx_counter_t *approx, size_t k) {
+  heavy_hitter_t *sorted = malloc((approx->size + 1) * sizeof(heavy_hitter_t));
 
-int main() {
+  memcpy(sorted, approx->hitters, approx->size * sizeof(heavy_hitter_t));
+  qsort(sorted, approx->size, sizeof(heavy_hitter_t), hitter_sort);
+
+  printf("Approximate counts over %ld words\n", approx->total);
+  printf("Count-Min %zu x %zu: overestimate <= %.0f with probability >= %g\n",
+         approx->width, approx->depth, approx->eps * approx->total,
+         1 - approx->delta);
+  printf("Space-Saving k=%zu: true count in [Count - Error, Count], "
+         "untracked words <= %ld\n",
+         approx->capacity, approx_floor(approx));
+  printf("%-30s %12s %12s %12s\n", "Word", "Count", "Error", "Estimate");
+  for (size_t i = 0; i < approx->size && i < k; i++) {
+    printf("%-30s %12ld %12ld %12ld\n", sorted[i].word, sorted[i].count,
+           sorted[i].error, sketch_estimate(approx, sorted[i].hash));
+  }
+  free(sorted);
+}
+
+// Map a whole file read-only. The pages are shared with the page cache, so
+// the worker threads count straight out of the mapping without copying.
+char *map_file(const char *path, size_t *len) {
+  struct stat st;
+  char *text;
+  int fd = open(path, O_RDONLY);
+
+  if (fd == -1) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  if (fstat(fd, &st) == -1) {
+    perror("fstat");
+    exit(EXIT_FAILURE);
+  }
+  *len = st.st_size;
+  if (*len == 0) {
+    close(fd);
+    return NULL;
+  }
+  text = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (text == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  // Every chunk is scanned front to back: ask for aggressive readahead
+  madvise(text, *len, MADV_SEQUENTIAL);
+  close(fd);
+  return text;
+}
+void unmap_file(char *text, size_t len) {
+  if (text != NULL) {
+    munmap(text, len);
+  }
+}
+#define TEST(expr)                                                             \
+  {                                                                            \
+    if (!(expr)) {                                                             \
+      fprintf(stderr, "Test failed: %s\n", #expr);                             \
+      exit(1);                                                                 \
+    } else {                                                                   \
+      printf("Test passed: %s\n", #expr);                                      \
+    }                                                                          \
+  }
+
+// Two tables match when they hold the same words with the same counts
+int same_word_counts(word_table_t *a, word_table_t *b) {
+  if (a->size != b->size)
+    return 0;
+  for (size_t i = 0; i < a->capacity; i++) {
+    word_count_t *entry = &a->slots[i];
+    if (entry->word) {
+      word_count_t *found = word_table_find(b, entry->word, entry->len);
+      if (found == NULL || found->count != entry->count)
+        return 0;
+    }
+  }
+  return 1;
+}
+// Check every SIMD tokenizer the CPU supports against the scalar one on
+// random text mixing cases, punctuation, high bytes and over-long words,
+// starting at every alignment within a 32-byte block.
+int run_self_test() {
+  const char *kernels[] = {"sse2", "avx2"};
+  size_t text_len = 1 << 14;
+  char *text = malloc(text_len);
+
+  srand(201);
+  for (size_t i = 0; i < text_len; i++) {
+    int r = rand() % 100;
+    if (r < 70)
+      text[i] = (r % 2 ? 'a' : 'A') + rand() % 26;
+    else if (r < 85)
+      text[i] = ' ';
+    else if (r < 95)
+      text[i] = "@[`{.,;!\n\t0"[rand() % 12];
+    else
+      text[i] = (char)(128 + rand() % 128);
+  }
+  memset(text + 1000, 'x', 300); // longer than the initial word buffer
+
+  for (int k = 0; k < 2; k++) {
+    chunk_counter_fn simd = find_chunk_counter(kernels[k]);
+    if (simd == NULL) {
+      printf("Skipping %s: not supported on this CPU\n", kernels[k]);
+      continue;
+    }
+    int same = 1;
+    for (size_t start = 0; start < 34 && same; start++) {
+      for (size_t cut = 0; cut < 34 && same; cut += 11) {
+        word_table_t expected = {0}, actual = {0};
+        size_t end = text_len - cut;
+        word_sink_t expected_sink = {&expected, NULL, NULL, NULL};
+        word_sink_t actual_sink = {&actual, NULL, NULL, NULL};
+        add_word_counts_in_chunk_scalar(text, start, end, &expected_sink);
+        simd(text, start, end, &actual_sink);
+        same = same_word_counts(&expected, &actual);
+        free_word_table(&expected);
+        free_word_table(&actual);
+      }
+    }
+    printf("%s: ", kernels[k]);
+    TEST(same);
+  }
+  free(text);
+  return 0;
+}
+// Bytes requested per read() in streaming mode
+#define STREAM_BLOCK_SIZE (1 << 20)
+
+// Snapshot publisher for streaming mode. The ingest thread counts into a
+// private delta table and, at each snapshot point, hands the whole delta
+// over here; the publisher folds it into word_counts and prints. The
+// cumulative table is only ever touched by the publisher, so every snapshot
+// covers exactly the first `bytes` bytes of the stream.
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t ready; // a delta was handed over, or the stream ended
+  pthread_cond_t idle;  // the previous delta has been published
+  word_table_t pending;
+  int has_pending;
+  int done;
+  size_t bytes;
+  unsigned snapshots;
+  long top_k;
+  int num_threads;
+} stream_publisher_t;
+
+void *publisher_thread_func(void *args) {
+  stream_publisher_t *pub = (stream_publisher_t *)args;
+
+  pthread_mutex_lock(&pub->lock);
+  for (;;) {
+    while (!pub->has_pending && !pub->done)
+      pthread_cond_wait(&pub->ready, &pub->lock);
+    if (!pub->has_pending)
+      break;
+    word_table_t delta = pub->pending;
+    size_t bytes = pub->bytes;
+    unsigned snapshot = ++pub->snapshots;
+    pthread_mutex_unlock(&pub->lock);
+
+    merge_word_counts(&word_counts, &delta);
+    printf("=== Snapshot %u: %zu bytes, %zu distinct words ===\n", snapshot,
+           bytes, word_counts.size);
+    if (pub->top_k >= 0) {
+      print_top_k(pub->top_k);
+    } else {
+      print_word_counts(pub->num_threads);
+    }
+    fflush(stdout);
+
+    pthread_mutex_lock(&pub->lock);
+    pub->has_pending = 0;
+    pthread_cond_signal(&pub->idle);
+  }
+  pthread_mutex_unlock(&pub->lock);
+  return NULL;
+}
+// Hand the delta to the publisher and start a fresh one. Unless wait is set,
+// gives up (returning 0) when the previous snapshot is still being printed,
+// so ingestion never stalls on a slow consumer; the delta just keeps growing
+// until the next attempt.
+int publish_snapshot(stream_publisher_t *pub, word_table_t *delta,
+                     size_t bytes, int wait) {
+  pthread_mutex_lock(&pub->lock);
+  if (pub->has_pending && !wait) {
+    pthread_mutex_unlock(&pub->lock);
+    return 0;
+  }
+  while (pub->has_pending)
+    pthread_cond_wait(&pub->idle, &pub->lock);
+  pub->pending = *delta;
+  pub->bytes = bytes;
+  pub->has_pending = 1;
+  pthread_cond_signal(&pub->ready);
+  pthread_mutex_unlock(&pub->lock);
+  memset(delta, 0, sizeof(word_table_t));
+  return 1;
+}
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+// Count a stream incrementally, reading fd in large blocks until EOF. Each
+// block is counted up to its last non-letter; a trailing partial word is
+// moved to the front of the buffer and completed by the next read. A
+// snapshot is published after every every_bytes bytes or every_sec seconds
+// (0 disables either trigger), and once more at EOF.
+void count_stream(int fd, size_t every_bytes, double every_sec, long top_k,
+                  int num_threads) {
+  stream_publisher_t pub = {0};
+  pthread_t publisher;
+  word_table_t delta = {0};
+  word_sink_t sink = {&delta, NULL, NULL, NULL};
+  size_t cap = STREAM_BLOCK_SIZE, have = 0, counted = 0, published = 0;
+  char *buf = malloc(cap);
+  double last_snapshot = now_seconds();
+
+  pthread_mutex_init(&pub.lock, NULL);
+  pthread_cond_init(&pub.ready, NULL);
+  pthread_cond_init(&pub.idle, NULL);
+  pub.top_k = top_k;
+  pub.num_threads = num_threads;
+  pthread_create(&publisher, NULL, publisher_thread_func, &pub);
+
+  for (;;) {
+    // With a time trigger, wake up for it even if the feed goes quiet
+    if (every_sec > 0) {
+      double left = last_snapshot + every_sec - now_seconds();
+      struct pollfd pfd = {fd, POLLIN, 0};
+      int ready = poll(&pfd, 1, left > 0 ? (int)(left * 1000) + 1 : 0);
+      if (ready == -1 && errno != EINTR) {
+        perror("poll");
+        break;
+      }
+      if (ready <= 0) {
+        if (now_seconds() - last_snapshot >= every_sec) {
+          if (counted > published &&
+              publish_snapshot(&pub, &delta, counted, 0))
+            published = counted;
+          last_snapshot = now_seconds();
+        }
+        continue;
+      }
+    }
+
+    // A single word longer than the buffer: grow it
+    if (have == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+    ssize_t num_read = read(fd, buf + have, cap - have);
+    if (num_read == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("read");
+      break;
+    }
+    if (num_read == 0)
+      break;
+    have += num_read;
+
+    size_t cut = have;
+    while (cut > 0 && isalpha((unsigned char)buf[cut - 1]))
+      cut--;
+    if (cut > 0) {
+      add_word_counts_in_chunk(buf, 0, cut, &sink);
+      memmove(buf, buf + cut, have - cut);
+      have -= cut;
+      counted += cut;
+    }
+
+    int due = every_bytes > 0 && counted - published >= every_bytes;
+    if (every_sec > 0 && now_seconds() - last_snapshot >= every_sec)
+      due = 1;
+    if (due && publish_snapshot(&pub, &delta, counted, 0)) {
+      published = counted;
+      last_snapshot = now_seconds();
+    }
+  }
+
+  add_word_counts_in_chunk(buf, 0, have, &sink);
+  counted += have;
+  publish_snapshot(&pub, &delta, counted, 1);
+
+  pthread_mutex_lock(&pub.lock);
+  pub.done = 1;
+  pthread_cond_signal(&pub.ready);
+  pthread_mutex_unlock(&pub.lock);
+  pthread_join(publisher, NULL);
+
+  pthread_mutex_destroy(&pub.lock);
+  pthread_cond_destroy(&pub.ready);
+  pthread_cond_destroy(&pub.idle);
+  free(buf);
+}
+// Settings and state shared by every document counted in one run
+typedef struct {
+  const char *mode;
+  int num_threads;
+  int num_shards;
+  count_pool_t *pool;
+  approx_counter_t *approx;
+} count_config_t;
+
+// Count one document with the selected mode; counts accumulate across calls
+void count_document(count_config_t *config, char *text, size_t text_len) {
+  const char *mode = config->mode;
+
+  if (strcmp(mode, "seq") == 0) {
+    count_words_seq(text, text_len);
+  } else if (strcmp(mode, "mutex") == 0) {
+    // TASK 2: Parallel version, one shared table behind count_mutex
+    count_words_parallel(text, text_len, config->num_threads);
+  } else if (strcmp(mode, "local") == 0) {
+    // Per-thread tables merged by tree reduction, no locks while counting
+    count_words_parallel_local(text, text_len, config->num_threads);
+  } else if (strcmp(mode, "pool") == 0) {
+    // Persistent workers with work stealing, reused for every document
+    count_pool_count(config->pool, text, text_len);
+  } else if (strcmp(mode, "sharded") == 0) {
+    // One shared table split into independently locked shards
+    count_words_sharded(text, text_len, config->num_threads,
+                        config->num_shards);
+  } else {
+    // Fixed-size sketch per thread, memory independent of the vocabulary
+    count_words_approx(text, text_len, config->num_threads, config->approx);
+  }
+}
+// Shape of the synthetic corpus the benchmark generates
+typedef struct {
+  size_t vocab_size;
+  double zipf_s;    // rank r is drawn with probability proportional to r^-s
+  int max_word_len; // vocabulary word lengths are uniform in [1, max]
+  int max_threads;
+  int reps;         // timed runs per configuration; the fastest is kept
+} bench_config_t;
+
+// xorshift64*: fast and good enough for test data
+uint64_t next_random(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+// Write size bytes of Zipf-distributed words to a fresh temporary file and
+// map it. The file is unlinked at once, so it disappears with the mapping.
+char *generate_corpus(bench_config_t *config, size_t size) {
+  char path[] = "/tmp/lab8-bench-XXXXXX";
+  int fd = mkstemp(path);
+  size_t vocab = config->vocab_size;
+  char **words = malloc(vocab * sizeof(char *));
+  double *cdf = malloc(vocab * sizeof(double));
+  char *block = malloc(STREAM_BLOCK_SIZE + 1);
+  uint64_t state = 0x9e3779b97f4a7c15ULL;
+  double sum = 0;
+
+  if (fd == -1) {
+    perror("mkstemp");
+    exit(EXIT_FAILURE);
+  }
+  unlink(path);
+  for (size_t r = 0; r < vocab; r++) {
+    int len = 1 + next_random(&state) % config->max_word_len;
+    words[r] = malloc(len + 1);
+    for (int c = 0; c < len; c++)
+      words[r][c] = 'a' + next_random(&state) % 26;
+    words[r][len] = '\0';
+    sum += 1.0 / pow(r + 1, config->zipf_s);
+    cdf[r] = sum;
+  }
+
+  for (size_t written = 0; written < size;) {
+    size_t used = 0;
+    while (used < STREAM_BLOCK_SIZE && written + used < size) {
+      double u = (next_random(&state) >> 11) * (1.0 / 9007199254740992.0);
+      size_t lo = 0, hi = vocab - 1;
+      while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (cdf[mid] < u * sum)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      for (char *c = words[lo]; *c && used < STREAM_BLOCK_SIZE; c++)
+        block[used++] = *c;
+      block[used++] = ' ';
+    }
+    if (written + used > size)
+      used = size - written;
+    if (write(fd, block, used) != (ssize_t)used) {
+      perror("write");
+      exit(EXIT_FAILURE);
+    }
+    written += used;
+  }
+
+  for (size_t r = 0; r < vocab; r++)
+    free(words[r]);
+  free(words);
+  free(cdf);
+  free(block);
+
+  char *text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (text == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  return text;
+}
+// A field of /proc/self/status in kB: "VmRSS:" for the resident set now,
+// "VmHWM:" for its peak since reset_peak_rss. -1 where /proc is missing.
+long read_rss_kb(const char *field) {
+  FILE *status = fopen("/proc/self/status", "r");
+  char line[256];
+  long kb = -1;
+
+  if (status == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), status)) {
+    if (strncmp(line, field, strlen(field)) == 0) {
+      kb = atol(line + strlen(field));
+      break;
+    }
+  }
+  fclose(status);
+  return kb;
+}
+// Restart the VmHWM peak from the current resident set (Linux 4.0+), so
+// each benchmark configuration is measured on its own rather than against
+// the process-wide ru_maxrss, which never comes down
+void reset_peak_rss() {
+  FILE *clear_refs = fopen("/proc/self/clear_refs", "w");
+  if (clear_refs != NULL) {
+    fputs("5", clear_refs);
+    fclose(clear_refs);
+  }
+}
+// Time one mode at one thread count, keeping the fastest of config->reps
+// runs, and check its final table against the sequential reference.
+// Returns 1 if every run matched.
+int bench_mode(bench_config_t *config, const char *mode, int num_threads,
+                char *text, size_t size, word_table_t *reference,
+                double seq_seconds) {
+  count_config_t count_config = {mode, num_threads, DEFAULT_NUM_SHARDS, NULL,
+                                 NULL};
+  double best = 0;
+  long total_words = 0;
+  int matches = 1;
+
+  // Peak memory is reported as growth over what is resident beforehand: the
+  // corpus, the reference table and whatever the previous runs left behind
+#ifdef __GLIBC__
+  malloc_trim(0);
+#endif
+  reset_peak_rss();
+  long base_rss = read_rss_kb("VmRSS:");
+  if (strcmp(mode, "pool") == 0)
+    count_config.pool = count_pool_create(num_threads);
+  for (int rep = 0; rep < config->reps; rep++) {
+    double start = now_seconds();
+    count_document(&count_config, text, size);
+    double seconds = now_seconds() - start;
+    best = rep == 0 || seconds < best ? seconds : best;
+    matches = matches && same_word_counts(reference, &word_counts);
+    free_word_table(&word_counts);
+  }
+  if (count_config.pool != NULL)
+    count_pool_destroy(count_config.pool);
+  long peak_rss = read_rss_kb("VmHWM:");
+  long rss_growth = peak_rss >= 0 && base_rss >= 0 ? peak_rss - base_rss : -1;
+
+  for (size_t i = 0; i < reference->capacity; i++) {
+    if (reference->slots[i].word)
+      total_words += reference->slots[i].count;
+  }
+  double speedup = seq_seconds > 0 ? seq_seconds / best : 1;
+  printf("%s,%zu,%d,%.6f,%.2f,%.0f,%.3f,%.3f,%ld,%zu,%s\n", mode, size,
+         num_threads, best, size / best / (1024 * 1024), total_words / best,
+         speedup, speedup / num_threads, rss_growth, reference->size,
+         matches ? "yes" : "NO");
+  fflush(stdout);
+  return matches;
+}
+// For every corpus size: generate it, time count_words_seq as the baseline
+// and reference table, then every parallel mode at 1, 2, 4, ... threads up
+// to max_threads. A small vocabulary (--vocab) makes threads collide on the
+// same words, the worst case for the shared-table modes. Prints one CSV row
+// per run; the exit status is nonzero if any run disagreed with the
+// sequential counts.
+int run_bench(bench_config_t *config, size_t *sizes, int num_sizes) {
+  // mutex and sharded side by side show what lock striping buys under
+  // contention; local and pool avoid shared state altogether
+  const char *modes[] = {"mutex", "sharded", "local", "pool"};
+  int all_match = 1;
+
+  printf("mode,bytes,threads,seconds,mb_per_s,words_per_s,speedup,"
+         "efficiency,peak_rss_growth_kb,distinct_words,matches_seq\n");
+  for (int i = 0; i < num_sizes; i++) {
+    fprintf(stderr, "Generating %zu-byte corpus...\n", sizes[i]);
+    char *text = generate_corpus(config, sizes[i]);
+    word_table_t reference;
+
+    double start = now_seconds();
+    count_words_seq(text, sizes[i]);
+    double seq_seconds = now_seconds() - start;
+    reference = word_counts;
+    memset(&word_counts, 0, sizeof(word_table_t));
+
+    all_match &= bench_mode(config, "seq", 1, text, sizes[i], &reference,
+                            seq_seconds);
+    for (int m = 0; m < 4; m++) {
+      int t = 1;
+      for (;;) {
+        all_match &= bench_mode(config, modes[m], t, text, sizes[i],
+                                &reference, seq_seconds);
+        if (t == config->max_threads)
+          break;
+        t = t * 2 < config->max_threads ? t * 2 : config->max_threads;
+      }
+    }
+    free_word_table(&reference);
+    munmap(text, sizes[i]);
+  }
+  return all_match ? 0 : 1;
+}
+// Parse a size such as 512K, 64M or 10G
+size_t parse_size(const char *str) {
+  char *end;
+  double value = strtod(str, &end);
+  switch (*end) {
+  case 'g':
+  case 'G':
+    value *= 1024;
+    /* fall through */
+  case 'm':
+  case 'M':
+    value *= 1024;
+    /* fall through */
+  case 'k':
+  case 'K':
+    value *= 1024;
+  }
+  return (size_t)value;
+}
+void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-m seq|mutex|sharded|local|pool|approx]\n"
+          "          [-t num_threads] [-f file]... [--shards N]\n"
+          "          [-k auto|scalar|sse2|avx2] [--top K] [--self-test]\n"
+          "          [--eps E] [--delta D] [--capacity K] (approx mode)\n"
+          "          [--stream [--fd N] [--every-mb M] [--every-sec S]]\n"
+          "          [--bench [--sizes 1M,64M,...] [--vocab V] [--zipf S]\n"
+          "                   [--max-word-len L] [--reps R]]\n",
+          prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
   char *text = "The quick brown fox jumps over the lazy dog. "
                "The quick brown fox jumps over the lazy dog.";
-  int text_len = strlen(text);
-  // Sequential version (comment out when using parallel)
-  // count_words_seq(text, text_len);
-
-  // TASK 2: Parallel version (uncomment to use)
+  size_t text_len = strlen(text);
+  const char *mode = "mutex";
+  const char *paths[argc];
+  int num_paths = 0;
   int num_threads = 3;
-  count_words_parallel(text, text_len, num_threads);
+  int num_shards = DEFAULT_NUM_SHARDS;
+  long top_k = -1;
+  double eps = 0.0001, delta = 0.01;
+  long capacity = 1000;
+  approx_counter_t approx = {0};
+  int stream = 0, stream_fd = STDIN_FILENO;
+  double every_mb = 0, every_sec = 0;
+  int bench = 0, num_sizes = 0;
+  size_t sizes[64];
+  bench_config_t bench_config = {100000, 1.0, 12, 0, 1};
 
-  // TASK 1: Sort the hash table before printing
-  HASH_SORT(word_counts, word_count_sort);
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+      mode = argv[++i];
+    } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      num_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+      paths[num_paths++] = argv[++i];
+    } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+      chunk_counter = find_chunk_counter(argv[++i]);
+      if (chunk_counter == NULL) {
+        fprintf(stderr, "Tokenizer %s is not available\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+      num_shards = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+      top_k = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--eps") == 0 && i + 1 < argc) {
+      eps = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--delta") == 0 && i + 1 < argc) {
+      delta = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--capacity") == 0 && i + 1 < argc) {
+      capacity = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--stream") == 0) {
+      stream = 1;
+    } else if (strcmp(argv[i], "--fd") == 0 && i + 1 < argc) {
+      stream_fd = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--every-mb") == 0 && i + 1 < argc) {
+      every_mb = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--every-sec") == 0 && i + 1 < argc) {
+      every_sec = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--bench") == 0) {
+      bench = 1;
+    } else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+      for (char *size = strtok(argv[++i], ","); size && num_sizes < 64;
+           size = strtok(NULL, ",")) {
+        sizes[num_sizes++] = parse_size(size);
+      }
+    } else if (strcmp(argv[i], "--vocab") == 0 && i + 1 < argc) {
+      bench_config.vocab_size = parse_size(argv[++i]);
+    } else if (strcmp(argv[i], "--zipf") == 0 && i + 1 < argc) {
+      bench_config.zipf_s = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--max-word-len") == 0 && i + 1 < argc) {
+      bench_config.max_word_len = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+      bench_config.reps = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--self-test") == 0) {
+      return run_self_test();
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (num_threads < 1 || eps <= 0 || delta <= 0 || delta >= 1 ||
+      capacity < 1 || num_shards < 1 || (num_shards & (num_shards - 1))) {
+    usage(argv[0]);
+  }
+  if (bench) {
+    if (bench_config.vocab_size < 1 || bench_config.max_word_len < 1 ||
+        bench_config.reps < 1) {
+      usage(argv[0]);
+    }
+    if (num_sizes == 0) {
+      sizes[num_sizes++] = parse_size("1M");
+      sizes[num_sizes++] = parse_size("64M");
+    }
+    bench_config.max_threads = num_threads;
+    return run_bench(&bench_config, sizes, num_sizes);
+  }
+  if (stream) {
+    // Snapshots are printed by the publisher as the stream is read
+    count_stream(stream_fd, (size_t)(every_mb * 1024 * 1024), every_sec,
+                 top_k, num_threads);
+    cleanup();
+    return 0;
+  }
+  if (strcmp(mode, "seq") != 0 && strcmp(mode, "mutex") != 0 &&
+      strcmp(mode, "sharded") != 0 && strcmp(mode, "local") != 0 &&
+      strcmp(mode, "pool") != 0 && strcmp(mode, "approx") != 0) {
+    usage(argv[0]);
+  }
+
+  count_config_t config = {mode, num_threads, num_shards, NULL, &approx};
+  if (strcmp(mode, "pool") == 0) {
+    config.pool = count_pool_create(num_threads);
+  }
+  if (strcmp(mode, "approx") == 0) {
+    approx_init(&approx, eps, delta, capacity);
+  }
 
-  // Print results
-  print_word_counts();
+  if (num_paths == 0) {
+    count_document(&config, text, text_len);
+  }
+  for (int i = 0; i < num_paths; i++) {
+    text = map_file(paths[i], &text_len);
+    count_document(&config, text, text_len);
+    unmap_file(text, text_len);
+  }
+  if (config.pool != NULL) {
+    count_pool_destroy(config.pool);
+  }
+
+  // Print results: only the heavy hitters, or everything sorted by word
+  if (approx.sketch != NULL) {
+    print_approx_counts(&approx, top_k >= 0 ? top_k : capacity);
+  } else if (top_k >= 0) {
+    print_top_k(top_k);
+  } else {
+    print_word_counts(num_threads);
+  }
 
   // Cleanup
   cleanup();
+  approx_free(&approx);
 
   return 0;
 }
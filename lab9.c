@@ -1,63 +1,768 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/io_uring.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #define BUF_SIZE 64
 #define PORT 8000
-#define LISTEN_BACKLOG 32
+#define LISTEN_BACKLOG SOMAXCONN
+// Events taken from the kernel per epoll_wait in reactor mode
+#define MAX_EVENTS 256
+// Submission queue size of each io_uring; completions get twice as many
+#define RING_ENTRIES 1024
+// BUF_SIZE buffers each io_uring hands to the kernel for recv (power of 2)
+#define RING_BUFFERS 4096
+#define RING_BUFFER_GROUP 0
+// user_data of the io_uring requests that are not a connection's recv: the
+// multishot accept, the one-shot accept that sheds a connection when out of
+// descriptors, and the timeout before re-arming accept after an error
+#define URING_ACCEPT 0
+#define URING_SHED_ACCEPT 1
+#define URING_ACCEPT_RETRY 2
+// How long io_uring mode waits before accepting again after an error
+#define ACCEPT_RETRY_NS 100000000
+// Framed modes: receive buffers start at, and read, this much at a time;
+// the io_uring provided buffers are this size too, fewer of them
+#define RECV_CHUNK (64 * 1024)
+#define RING_FRAME_BUFFERS 256
+// Largest frame accepted, well under LOG_RING_SIZE so any frame can be
+// logged; a longer one, or a bad length prefix, closes the connection
+#define MAX_FRAME (256 * 1024)
+// A varint length prefix up to MAX_FRAME takes at most this many bytes
+#define MAX_VARINT_BYTES 3
+// Messages each benchmark client sends
+#define BENCH_MESSAGES 100
+// Per-thread counter blocks; threads beyond this many share them
+#define STATS_SHARDS 64
+// Busiest clients listed by the periodic stats report
+#define STATS_TOP_CLIENTS 5
+// Bytes per log ring (power of 2). Every server thread has one; pages are
+// only committed as the ring fills.
+#define LOG_RING_SIZE (1 << 20)
+// Returned rings kept for new threads; the writer frees any beyond this
+// once they are drained, so ring memory follows the live thread count
+#define LOG_IDLE_RINGS 4
+// How long the log writer sleeps when every ring is empty
+#define LOG_IDLE_NS 1000000
+
+// Server modes
+#define MODE_THREADS 0
+#define MODE_EPOLL 1
+#define MODE_URING 2
+
+// How a client's byte stream is split into messages: raw counts each read()
+// as one, the framed modes use newline-terminated lines or frames prefixed
+// with their length as a varint (7 bits per byte, low bits first)
+#define FRAMING_RAW 0
+#define FRAMING_LINES 1
+#define FRAMING_VARINT 2
 
 #define handle_error(msg)                                                      \
   do {                                                                         \
     perror(msg);                                                               \
     exit(EXIT_FAILURE);                                                        \
   } while (0)
-// Shared counters for: total # messages, and counter of clients (used for
-// assigning client IDs)
-int total_message_count = 0;
+// Counter of clients, used for assigning client IDs with an atomic
+// fetch-add
 int client_id_counter = 1;
 
-// Mutexs to protect above global state.
-pthread_mutex_t count_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t client_id_mutex = PTHREAD_MUTEX_INITIALIZER;
+int framing = FRAMING_RAW;
+
+// Server counters, one cache line per thread so that counting never bounces
+// a line between cores. Totals are summed over the shards on demand.
+// syscalls counts what the server loops make to accept and receive (output
+// writes are the same in every mode and not counted).
+struct stats_shard {
+  long messages;
+  long bytes;
+  long connections_opened;
+  long connections_closed;
+  long syscalls;
+} __attribute__((aligned(64)));
+
+struct stats_shard stats_shards[STATS_SHARDS];
+int stats_threads = 0; // threads that have claimed a shard so far
+__thread struct stats_shard *thread_shard = NULL;
+
+// Per-client counters, written only by the thread serving the client. Open
+// clients are kept on a list for snapshots; the lock is only taken when a
+// client connects or disconnects, and by snapshots.
+struct client_stats {
+  int client_id;
+  long messages;
+  long bytes;
+  struct timespec connected_at;
+  struct client_stats *prev;
+  struct client_stats *next;
+};
+
+struct client_stats *open_clients = NULL;
+pthread_mutex_t open_clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// A point-in-time view of the server, from stats_snapshot
+struct client_rate {
+  int client_id;
+  long messages;
+  long bytes;
+  double messages_per_s;
+};
+
+struct server_stats {
+  long messages;
+  long bytes;
+  long active_connections;
+  long total_connections;
+  long syscalls;
+  int num_clients; // entries in clients, when requested
+  struct client_rate *clients;
+};
+
+// Output pipeline: server threads format each message's output as one
+// record and append it to their own single-producer ring, which never
+// blocks; when a ring is full the record is dropped and counted. One writer
+// thread drains all rings with writev, so records reach the log whole.
+struct log_ring {
+  char *data;
+  int in_use; // claimed by a live thread; under log_rings_mutex
+  long dropped;
+  size_t tail __attribute__((aligned(64))); // producer: bytes appended
+  size_t head __attribute__((aligned(64))); // writer: bytes written out
+};
+
+// Every ring in use or pooled for the next new thread. Only the writer
+// frees rings, under the lock, so its own copies of the list stay valid;
+// anyone else reads ring fields under the lock. The lock is taken when a
+// thread claims or returns its ring, and by the writer to list the rings;
+// never per record.
+struct log_ring **log_rings = NULL;
+int num_log_rings = 0;
+int idle_log_rings = 0;  // rings on the list not in use
+long retired_drops = 0; // drops counted by freed rings; writer only
+pthread_mutex_t log_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+__thread struct log_ring *thread_ring = NULL;
+pthread_key_t log_ring_key;
+int log_fd = STDOUT_FILENO;
+
+// Framed modes: what a connection has received but not yet parsed into
+// whole frames, always starting at the beginning of a frame
+struct frame_buffer {
+  char *data;
+  size_t len;
+  size_t capacity;
+};
 
 struct client_info {
   int cfd;
-  int client_id;
+  struct client_stats stats;
+  struct frame_buffer frames;
+};
+
+// Reactor mode: a connection lives on the event loop that accepted it, and
+// its state is this struct, found through the epoll event's data pointer
+struct connection {
+  int cfd;
+  int failed; // io_uring: sent a bad frame, ignore data until the recv ends
+  struct client_stats stats;
+  struct frame_buffer frames;
+};
+
+struct event_loop {
+  int epfd;
+  int sfd;
+  int spare_fd; // released to shed a connection when out of descriptors
+  pthread_t thread;
 };
+
+// io_uring mode: one ring per loop thread, shared with the kernel through
+// the mapped submission and completion queues, plus a ring of provided
+// buffers that multishot recv picks from
+struct uring_loop {
+  int ring_fd;
+  int sfd;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sq_local_tail; // SQEs prepared, not yet published to the kernel
+  unsigned sq_submitted;  // SQEs the kernel has taken
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  struct io_uring_buf_ring *buf_ring;
+  unsigned short buf_tail;
+  int spare_fd; // released to shed a connection when out of descriptors
+  struct __kernel_timespec retry_after; // read by the kernel on submission
+  char *buffers;      // num_buffers * buf_size bytes
+  unsigned num_buffers; // RING_BUFFERS, or RING_FRAME_BUFFERS when framed
+  size_t buf_size;      // BUF_SIZE, or RECV_CHUNK when framed
+  pthread_t thread;
+};
+
+double seconds_since(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// This thread's counters. Event loops each get their own shard; in
+// thread-per-client mode, threads past STATS_SHARDS share them, which is
+// why the updates are atomic (uncontended, so cheap, when not shared).
+struct stats_shard *my_shard(void) {
+  if (thread_shard == NULL) {
+    int index = __atomic_fetch_add(&stats_threads, 1, __ATOMIC_RELAXED);
+    thread_shard = &stats_shards[index % STATS_SHARDS];
+  }
+  return thread_shard;
+}
+
+void add_stat(long *counter, long amount) {
+  __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+void count_syscall(void) { add_stat(&my_shard()->syscalls, 1); }
+
+int next_client_id(void) {
+  return __atomic_fetch_add(&client_id_counter, 1, __ATOMIC_RELAXED);
+}
+
+void client_opened(struct client_stats *client) {
+  client->client_id = next_client_id();
+  client->messages = 0;
+  client->bytes = 0;
+  clock_gettime(CLOCK_MONOTONIC, &client->connected_at);
+  add_stat(&my_shard()->connections_opened, 1);
+
+  pthread_mutex_lock(&open_clients_mutex);
+  client->prev = NULL;
+  client->next = open_clients;
+  if (open_clients != NULL) {
+    open_clients->prev = client;
+  }
+  open_clients = client;
+  pthread_mutex_unlock(&open_clients_mutex);
+}
+
+void client_closed(struct client_stats *client) {
+  add_stat(&my_shard()->connections_closed, 1);
+
+  pthread_mutex_lock(&open_clients_mutex);
+  if (client->prev != NULL) {
+    client->prev->next = client->next;
+  } else {
+    open_clients = client->next;
+  }
+  if (client->next != NULL) {
+    client->next->prev = client->prev;
+  }
+  pthread_mutex_unlock(&open_clients_mutex);
+}
+
+// Thread exit: give the ring back. Records still in it are written out as
+// usual, and the next thread to claim it appends after them.
+void release_log_ring(void *ring) {
+  pthread_mutex_lock(&log_rings_mutex);
+  ((struct log_ring *)ring)->in_use = 0;
+  idle_log_rings++;
+  pthread_mutex_unlock(&log_rings_mutex);
+  // The writer may free it from now on
+  thread_ring = NULL;
+}
+
+// Take a pooled ring, or add a new one when every ring is in use
+struct log_ring *claim_log_ring(void) {
+  struct log_ring *ring = NULL;
+
+  pthread_mutex_lock(&log_rings_mutex);
+  for (int i = 0; i < num_log_rings && ring == NULL; i++) {
+    if (!log_rings[i]->in_use) {
+      ring = log_rings[i];
+      idle_log_rings--;
+    }
+  }
+  if (ring == NULL) {
+    struct log_ring **grown =
+        realloc(log_rings, (num_log_rings + 1) * sizeof(struct log_ring *));
+    if (grown == NULL ||
+        posix_memalign((void **)&ring, 64, sizeof(struct log_ring)) != 0) {
+      handle_error("claim_log_ring");
+    }
+    memset(ring, 0, sizeof(struct log_ring));
+    ring->data = malloc(LOG_RING_SIZE);
+    if (ring->data == NULL) {
+      handle_error("malloc");
+    }
+    log_rings = grown;
+    log_rings[num_log_rings++] = ring;
+  }
+  ring->in_use = 1;
+  pthread_mutex_unlock(&log_rings_mutex);
+  pthread_setspecific(log_ring_key, ring);
+  return ring;
+}
+
+// Copy the list of rings, so the writer can go through it unlocked. *rings
+// and *capacity are the caller's array, grown as needed. Returns the count.
+int list_log_rings(struct log_ring ***rings, int *capacity) {
+  pthread_mutex_lock(&log_rings_mutex);
+  int count = num_log_rings;
+  if (count > *capacity) {
+    *rings = realloc(*rings, count * sizeof(struct log_ring *));
+    if (*rings == NULL) {
+      handle_error("realloc");
+    }
+    *capacity = count;
+  }
+  if (count > 0) {
+    memcpy(*rings, log_rings, count * sizeof(struct log_ring *));
+  }
+  pthread_mutex_unlock(&log_rings_mutex);
+  return count;
+}
+
+// Append one record, made of count parts, to this thread's ring without
+// ever waiting on the writer; the record is dropped if it does not fit
+void log_record(const struct iovec *parts, int count) {
+  struct log_ring *ring = thread_ring;
+  size_t len = 0;
+
+  for (int i = 0; i < count; i++) {
+    len += parts[i].iov_len;
+  }
+
+  if (ring == NULL) {
+    ring = thread_ring = claim_log_ring();
+  }
+
+  size_t tail = ring->tail;
+  size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  if (LOG_RING_SIZE - (tail - head) < len) {
+    __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+  } else {
+    for (int i = 0; i < count; i++) {
+      const char *part = parts[i].iov_base;
+      size_t part_len = parts[i].iov_len;
+      size_t at = tail & (LOG_RING_SIZE - 1);
+      size_t first =
+          part_len < LOG_RING_SIZE - at ? part_len : LOG_RING_SIZE - at;
+      memcpy(ring->data + at, part, first);
+      memcpy(ring->data, part + first, part_len - first);
+      tail += part_len;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+  }
+}
+
+// Write every iovec in full, resuming after partial writes and taking at
+// most IOV_MAX at a time
+void write_all(int fd, struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t wrote = writev(fd, iov, count < IOV_MAX ? count : IOV_MAX);
+    if (wrote == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      handle_error("writev");
+    }
+    while (count > 0 && (size_t)wrote >= iov->iov_len) {
+      wrote -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + wrote;
+      iov->iov_len -= wrote;
+    }
+  }
+}
+
+// Drain every ring once: one writev covers all of them (two iovecs for a
+// ring whose contents wrap). Only the log writer drains, so the arrays
+// kept between calls are its own. Returns the bytes written.
+size_t drain_log_rings(void) {
+  static struct log_ring **rings = NULL;
+  static struct iovec *iov = NULL;
+  static size_t *tails = NULL;
+  static int capacity = 0;
+  int count = 0;
+  size_t total = 0;
+
+  int listed = capacity;
+  int num_rings = list_log_rings(&rings, &capacity);
+  if (capacity > listed) {
+    iov = realloc(iov, 2 * capacity * sizeof(struct iovec));
+    tails = realloc(tails, capacity * sizeof(size_t));
+    if (iov == NULL || tails == NULL) {
+      handle_error("realloc");
+    }
+  }
+  for (int i = 0; i < num_rings; i++) {
+    struct log_ring *ring = rings[i];
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t head = ring->head;
+    tails[i] = tail;
+    if (tail == head) {
+      continue;
+    }
+    size_t at = head & (LOG_RING_SIZE - 1);
+    size_t len = tail - head;
+    size_t first = len < LOG_RING_SIZE - at ? len : LOG_RING_SIZE - at;
+    iov[count].iov_base = ring->data + at;
+    iov[count++].iov_len = first;
+    if (len > first) {
+      iov[count].iov_base = ring->data;
+      iov[count++].iov_len = len - first;
+    }
+    total += len;
+  }
+  if (count == 0) {
+    return 0;
+  }
+  write_all(log_fd, iov, count);
+  for (int i = 0; i < num_rings; i++) {
+    __atomic_store_n(&rings[i]->head, tails[i], __ATOMIC_RELEASE);
+  }
+  return total;
+}
+
+// Free drained rings nobody uses while more than LOG_IDLE_RINGS are idle.
+// Called by the writer only.
+void trim_log_rings(void) {
+  pthread_mutex_lock(&log_rings_mutex);
+  for (int i = 0; i < num_log_rings && idle_log_rings > LOG_IDLE_RINGS;) {
+    struct log_ring *ring = log_rings[i];
+    if (ring->in_use || ring->head != ring->tail) {
+      i++;
+      continue;
+    }
+    retired_drops += ring->dropped;
+    log_rings[i] = log_rings[--num_log_rings];
+    idle_log_rings--;
+    free(ring->data);
+    free(ring);
+  }
+  pthread_mutex_unlock(&log_rings_mutex);
+}
+
+void *log_writer(void *arg) {
+  struct timespec idle = {0, LOG_IDLE_NS};
+  struct log_ring **rings = NULL;
+  int capacity = 0;
+  long reported_drops = 0;
+
+  (void)arg;
+  for (;;) {
+    if (drain_log_rings() == 0) {
+      nanosleep(&idle, NULL);
+    }
+    trim_log_rings();
+    long drops = retired_drops;
+    int num_rings = list_log_rings(&rings, &capacity);
+    for (int i = 0; i < num_rings; i++) {
+      drops += __atomic_load_n(&rings[i]->dropped, __ATOMIC_RELAXED);
+    }
+    if (drops > reported_drops) {
+      fprintf(stderr, "log: %ld records dropped, output too slow\n",
+              drops - reported_drops);
+      reported_drops = drops;
+    }
+  }
+  return NULL;
+}
+
+// Send the server's output to fd through the log writer thread
+void start_log(int fd) {
+  pthread_t writer;
+
+  log_fd = fd;
+  pthread_key_create(&log_ring_key, release_log_ring);
+  pthread_create(&writer, NULL, log_writer, NULL);
+  pthread_detach(writer);
+}
+
+// Wait until every ring is empty. The rings are checked under the lock, as
+// the writer may free idle ones; the caller stops logging first.
+void flush_log(void) {
+  struct timespec idle = {0, LOG_IDLE_NS};
+  int pending;
+
+  do {
+    pending = 0;
+    pthread_mutex_lock(&log_rings_mutex);
+    for (int i = 0; i < num_log_rings && !pending; i++) {
+      pending = __atomic_load_n(&log_rings[i]->head, __ATOMIC_ACQUIRE) !=
+                __atomic_load_n(&log_rings[i]->tail, __ATOMIC_ACQUIRE);
+    }
+    pthread_mutex_unlock(&log_rings_mutex);
+    if (pending) {
+      nanosleep(&idle, NULL);
+    }
+  } while (pending);
+}
+
+// One read() of a client is one message, in every server mode, unless the
+// stream is framed: then every frame is one message
+void record_message(struct client_stats *client, const char *buf,
+                    size_t num_read) {
+  struct stats_shard *shard = my_shard();
+
+  // Only this thread writes the client's counters; the atomic stores are
+  // for snapshots reading them concurrently
+  __atomic_store_n(&client->messages, client->messages + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&client->bytes, client->bytes + num_read,
+                   __ATOMIC_RELAXED);
+  add_stat(&shard->bytes, num_read);
+  add_stat(&shard->messages, 1);
+
+  // The client tag, the data and the client's running count form one
+  // record. Server-wide totals are only summed by stats snapshots, so this
+  // path never reads other threads' shards.
+  char tag[32], total[48];
+  struct iovec parts[3];
+  parts[0].iov_base = tag;
+  parts[0].iov_len =
+      snprintf(tag, sizeof(tag), "[Client %d]: ", client->client_id);
+  parts[1].iov_base = (char *)buf;
+  parts[1].iov_len = num_read;
+  parts[2].iov_base = total;
+  parts[2].iov_len = snprintf(total, sizeof(total),
+                              "Messages received from client: %ld\n",
+                              client->messages);
+  log_record(parts, 3);
+}
+
+// Make room for at least RECV_CHUNK more bytes at the end of fb and return
+// where they go. The buffer doubles while a frame bigger than it arrives.
+char *frame_space(struct frame_buffer *fb) {
+  if (fb->capacity - fb->len < RECV_CHUNK) {
+    size_t capacity = fb->capacity ? fb->capacity : RECV_CHUNK;
+    while (capacity - fb->len < RECV_CHUNK) {
+      capacity *= 2;
+    }
+    fb->data = realloc(fb->data, capacity);
+    if (fb->data == NULL) {
+      handle_error("realloc");
+    }
+    fb->capacity = capacity;
+  }
+  return fb->data + fb->len;
+}
+
+void free_frames(struct frame_buffer *fb) {
+  free(fb->data);
+  fb->data = NULL;
+  fb->len = fb->capacity = 0;
+}
+
+// Size of the frame at the start of data, header included, or 0 if it has
+// not all arrived; -1 if it is malformed or longer than MAX_FRAME. *payload
+// and *payload_len locate the message inside it.
+ssize_t next_frame(const char *data, size_t len, const char **payload,
+                   size_t *payload_len) {
+  if (framing == FRAMING_LINES) {
+    const char *end = memchr(data, '\n', len < MAX_FRAME ? len : MAX_FRAME);
+    if (end == NULL) {
+      return len < MAX_FRAME ? 0 : -1;
+    }
+    *payload = data;
+    *payload_len = end - data + 1;
+    return *payload_len;
+  }
+
+  size_t size = 0;
+  for (size_t i = 0; i < len && i < MAX_VARINT_BYTES; i++) {
+    unsigned char byte = (unsigned char)data[i];
+    size |= (size_t)(byte & 0x7f) << (7 * i);
+    if (size > MAX_FRAME) {
+      return -1;
+    }
+    if (!(byte & 0x80)) {
+      if (len - (i + 1) < size) {
+        return 0;
+      }
+      *payload = data + i + 1;
+      *payload_len = size;
+      return i + 1 + size;
+    }
+  }
+  return len < MAX_VARINT_BYTES ? 0 : -1;
+}
+
+// Record every whole frame in data. Returns how many bytes they took, the
+// rest being the start of a frame still arriving, or -1 on a bad frame.
+ssize_t parse_frames(struct client_stats *client, const char *data,
+                     size_t len) {
+  size_t used = 0;
+
+  for (;;) {
+    const char *payload;
+    size_t payload_len;
+    ssize_t size = next_frame(data + used, len - used, &payload, &payload_len);
+    if (size == -1) {
+      fprintf(stderr, "Client %d sent a bad frame, closing\n",
+              client->client_id);
+      return -1;
+    }
+    if (size == 0) {
+      return used;
+    }
+    record_message(client, payload, payload_len);
+    used += size;
+  }
+}
+
+// Parse the fb->len bytes in fb, the newest of which were just received
+// into frame_space, and keep only the unfinished frame. Returns -1 on a bad
+// frame.
+int consume_frames(struct client_stats *client, struct frame_buffer *fb) {
+  ssize_t used = parse_frames(client, fb->data, fb->len);
+  if (used == -1) {
+    return -1;
+  }
+  fb->len -= used;
+  memmove(fb->data, fb->data + used, fb->len);
+  // Give back what a big frame grew the buffer to
+  if (fb->len == 0 && fb->capacity > RECV_CHUNK) {
+    free_frames(fb);
+  }
+  return 0;
+}
+
+// Sum the shards into snap. With with_clients, also list every open
+// client's counters and message rate since it connected (free with
+// free_stats_snapshot).
+void stats_snapshot(struct server_stats *snap, int with_clients) {
+  int used = __atomic_load_n(&stats_threads, __ATOMIC_RELAXED);
+  long closed = 0;
+
+  memset(snap, 0, sizeof(*snap));
+  for (int i = 0; i < used && i < STATS_SHARDS; i++) {
+    struct stats_shard *shard = &stats_shards[i];
+    snap->messages += __atomic_load_n(&shard->messages, __ATOMIC_RELAXED);
+    snap->bytes += __atomic_load_n(&shard->bytes, __ATOMIC_RELAXED);
+    snap->total_connections +=
+        __atomic_load_n(&shard->connections_opened, __ATOMIC_RELAXED);
+    closed += __atomic_load_n(&shard->connections_closed, __ATOMIC_RELAXED);
+    snap->syscalls += __atomic_load_n(&shard->syscalls, __ATOMIC_RELAXED);
+  }
+  snap->active_connections = snap->total_connections - closed;
+  if (!with_clients) {
+    return;
+  }
+
+  pthread_mutex_lock(&open_clients_mutex);
+  int capacity = 0;
+  for (struct client_stats *c = open_clients; c != NULL; c = c->next) {
+    capacity++;
+  }
+  snap->clients = malloc((capacity + 1) * sizeof(struct client_rate));
+  for (struct client_stats *c = open_clients; c != NULL; c = c->next) {
+    struct client_rate *rate = &snap->clients[snap->num_clients++];
+    double seconds = seconds_since(&c->connected_at);
+    rate->client_id = c->client_id;
+    rate->messages = __atomic_load_n(&c->messages, __ATOMIC_RELAXED);
+    rate->bytes = __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+    rate->messages_per_s = seconds > 0 ? rate->messages / seconds : 0;
+  }
+  pthread_mutex_unlock(&open_clients_mutex);
+}
+
+void free_stats_snapshot(struct server_stats *snap) {
+  free(snap->clients);
+  snap->clients = NULL;
+  snap->num_clients = 0;
+}
+
+int compare_rates(const void *a, const void *b) {
+  const struct client_rate *x = a, *y = b;
+  return (x->messages_per_s < y->messages_per_s) -
+         (x->messages_per_s > y->messages_per_s);
+}
+
+// -S: every interval seconds, report the totals and the busiest clients on
+// stderr
+void *stats_reporter(void *arg) {
+  int interval = (int)(intptr_t)arg;
+  struct server_stats snap;
+
+  for (;;) {
+    sleep(interval);
+    stats_snapshot(&snap, 1);
+    qsort(snap.clients, snap.num_clients, sizeof(struct client_rate),
+          compare_rates);
+    fprintf(stderr,
+            "stats: %ld messages, %ld bytes, %ld active of %ld connections\n",
+            snap.messages, snap.bytes, snap.active_connections,
+            snap.total_connections);
+    for (int i = 0; i < snap.num_clients && i < STATS_TOP_CLIENTS; i++) {
+      fprintf(stderr, "stats:   client %d: %ld messages, %.1f/s\n",
+              snap.clients[i].client_id, snap.clients[i].messages,
+              snap.clients[i].messages_per_s);
+    }
+    free_stats_snapshot(&snap);
+  }
+  return NULL;
+}
+
 void *handle_client(void *arg) {
   char buf[BUF_SIZE];
   ssize_t num_read = 0;
 
   struct client_info *client = (struct client_info *)arg;
 
-  while ((num_read = read(client->cfd, buf, BUF_SIZE)) > 0) {
-    printf("[Client %d]: ", client->client_id);
-    write(STDOUT_FILENO, buf, num_read);
-    pthread_mutex_lock(&count_mutex);
-    total_message_count++;
-    printf("Total messages received: %d\n", total_message_count);
-    pthread_mutex_unlock(&count_mutex);
+  if (framing == FRAMING_RAW) {
+    while ((num_read = read(client->cfd, buf, BUF_SIZE)) > 0) {
+      count_syscall();
+      record_message(&client->stats, buf, num_read);
+    }
+  } else {
+    // Big reads: one can take in many frames, and the end of one frame is
+    // kept until the rest of it comes
+    while ((num_read = read(client->cfd, frame_space(&client->frames),
+                            RECV_CHUNK)) > 0) {
+      count_syscall();
+      client->frames.len += num_read;
+      if (consume_frames(&client->stats, &client->frames) == -1) {
+        break;
+      }
+    }
+    free_frames(&client->frames);
   }
+  client_closed(&client->stats);
+  close(client->cfd);
+  free(client);
   return NULL;
 }
 
-int main() {
+int open_listener(int port) {
   struct sockaddr_in addr;
   int sfd;
-  pthread_t thread_id;
+  int one = 1;
 
   sfd = socket(AF_INET, SOCK_STREAM, 0);
   if (sfd == -1) {
     handle_error("socket");
   }
+  setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
   memset(&addr, 0, sizeof(struct sockaddr_in));
   addr.sin_family = AF_INET;
-  addr.sin_port = htons(PORT);
+  addr.sin_port = htons(port);
   addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
   if (bind(sfd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) == -1) {
@@ -67,25 +772,702 @@ int main() {
   if (listen(sfd, LISTEN_BACKLOG) == -1) {
     handle_error("listen");
   }
+  return sfd;
+}
+
+// Thread-per-client mode: accept forever, one detached thread per client
+void *accept_loop(void *arg) {
+  int sfd = (int)(intptr_t)arg;
+  pthread_t thread_id;
+
   for (;;) {
     int cfd = accept(sfd, NULL, NULL);
-    struct client_info *client = malloc(sizeof(struct client_info));
-    pthread_mutex_lock(&client_id_mutex);
-    client->client_id = client_id_counter++;
-    pthread_mutex_unlock(&client_id_mutex);
+    count_syscall();
+    if (cfd == -1) {
+      perror("accept");
+      continue;
+    }
+    struct client_info *client = calloc(1, sizeof(struct client_info));
+    client_opened(&client->stats);
 
     client->cfd = cfd;
 
-    pthread_create(&thread_id, NULL, handle_client, client);
+    if (pthread_create(&thread_id, NULL, handle_client, client) != 0) {
+      perror("pthread_create");
+      client_closed(&client->stats);
+      close(cfd);
+      free(client);
+      continue;
+    }
     pthread_detach(thread_id);
   }
-  if (close(sfd) == -1) {
-    handle_error("close");
+  return NULL;
+}
+
+void close_connection(struct connection *conn) {
+  // Closing the last reference also drops it from the epoll set
+  client_closed(&conn->stats);
+  close(conn->cfd);
+  free_frames(&conn->frames);
+  free(conn);
+}
+
+// Edge-triggered: a readiness event is reported once, so drain the socket
+// until read() would block. Every read is still one message.
+void handle_readable(struct connection *conn) {
+  char buf[BUF_SIZE];
+
+  for (;;) {
+    ssize_t num_read;
+    if (framing == FRAMING_RAW) {
+      num_read = read(conn->cfd, buf, BUF_SIZE);
+    } else {
+      num_read = read(conn->cfd, frame_space(&conn->frames), RECV_CHUNK);
+    }
+    count_syscall();
+    if (num_read > 0 && framing == FRAMING_RAW) {
+      record_message(&conn->stats, buf, num_read);
+    } else if (num_read > 0) {
+      conn->frames.len += num_read;
+      if (consume_frames(&conn->stats, &conn->frames) == -1) {
+        close_connection(conn);
+        return;
+      }
+    } else if (num_read == -1 && errno == EINTR) {
+      continue;
+    } else if (num_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    } else {
+      close_connection(conn);
+      return;
+    }
+  }
+}
+
+// Accept every pending connection onto this loop
+void handle_acceptable(struct event_loop *loop) {
+  for (;;) {
+    int cfd = accept4(loop->sfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    count_syscall();
+    if (cfd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if ((errno == EMFILE || errno == ENFILE) && loop->spare_fd != -1) {
+        // The listener stays readable while the queue is non-empty, so
+        // refusing nothing would spin; use the spare descriptor to accept
+        // and drop one connection
+        perror("accept4");
+        close(loop->spare_fd);
+        close(accept(loop->sfd, NULL, NULL));
+        loop->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("accept4");
+      }
+      return;
+    }
+
+    struct connection *conn = calloc(1, sizeof(struct connection));
+    struct epoll_event ev;
+    conn->cfd = cfd;
+    client_opened(&conn->stats);
+    ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, cfd, &ev) == -1) {
+      perror("epoll_ctl");
+      close_connection(conn);
+      continue;
+    }
+    // Data that arrived before registration raises no edge; read it now
+    handle_readable(conn);
+  }
+}
+
+void *event_loop_thread(void *arg) {
+  struct event_loop *loop = (struct event_loop *)arg;
+  struct epoll_event events[MAX_EVENTS];
+
+  for (;;) {
+    int num_events = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+    count_syscall();
+    if (num_events == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      handle_error("epoll_wait");
+    }
+    for (int i = 0; i < num_events; i++) {
+      // The listening socket is registered with a NULL data pointer
+      if (events[i].data.ptr == NULL) {
+        handle_acceptable(loop);
+      } else {
+        handle_readable((struct connection *)events[i].data.ptr);
+      }
+    }
+  }
+  return NULL;
+}
+
+// Reactor mode: num_loops threads, each with its own epoll set. They share
+// the non-blocking listening socket; EPOLLEXCLUSIVE wakes only one of them
+// per new connection, and that loop owns the connection from then on.
+struct event_loop *start_event_loops(int sfd, int num_loops) {
+  struct event_loop *loops = calloc(num_loops, sizeof(struct event_loop));
+
+  if (fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL) | O_NONBLOCK) == -1) {
+    handle_error("fcntl");
+  }
+  for (int i = 0; i < num_loops; i++) {
+    struct epoll_event ev;
+    loops[i].sfd = sfd;
+    loops[i].spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    loops[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loops[i].epfd == -1) {
+      handle_error("epoll_create1");
+    }
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, sfd, &ev) == -1) {
+      handle_error("epoll_ctl");
+    }
+    pthread_create(&loops[i].thread, NULL, event_loop_thread, &loops[i]);
+  }
+  return loops;
+}
+
+// Hand buffer bid back to the kernel; it becomes visible on the next
+// publish_buffers. Only addr, len and bid are written: the resv field of
+// entry 0 is where the ring's tail lives.
+void recycle_buffer(struct uring_loop *loop, int bid) {
+  struct io_uring_buf *buf =
+      &loop->buf_ring->bufs[loop->buf_tail & (loop->num_buffers - 1)];
+  buf->addr =
+      (uint64_t)(uintptr_t)(loop->buffers + (size_t)bid * loop->buf_size);
+  buf->len = loop->buf_size;
+  buf->bid = (unsigned short)bid;
+  loop->buf_tail++;
+}
+
+void publish_buffers(struct uring_loop *loop) {
+  __atomic_store_n(&loop->buf_ring->tail, loop->buf_tail, __ATOMIC_RELEASE);
+}
+
+// Map the rings of a new io_uring and register its provided buffers.
+// Returns -1 with errno set when the kernel lacks what this mode needs.
+int setup_uring(struct uring_loop *loop, int sfd) {
+  struct io_uring_params params;
+  struct io_uring_buf_reg reg;
+  size_t sq_size, cq_size, buf_ring_size;
+  char *sq_ring, *cq_ring;
+
+  memset(loop, 0, sizeof(*loop));
+  memset(&params, 0, sizeof(params));
+  loop->sfd = sfd;
+  loop->num_buffers =
+      framing == FRAMING_RAW ? RING_BUFFERS : RING_FRAME_BUFFERS;
+  loop->buf_size = framing == FRAMING_RAW ? BUF_SIZE : RECV_CHUNK;
+  loop->ring_fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+  if (loop->ring_fd == -1) {
+    return -1;
+  }
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    close(loop->ring_fd);
+    errno = ENOSYS;
+    return -1;
+  }
+
+  // One mapping covers both queues' indexes; the SQE array is separate
+  sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  sq_ring = mmap(NULL, sq_size > cq_size ? sq_size : cq_size,
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 loop->ring_fd, IORING_OFF_SQ_RING);
+  loop->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    loop->ring_fd, IORING_OFF_SQES);
+  if (sq_ring == MAP_FAILED || loop->sqes == MAP_FAILED) {
+    handle_error("mmap");
+  }
+  cq_ring = sq_ring;
+  loop->sq_head = (unsigned *)(sq_ring + params.sq_off.head);
+  loop->sq_tail = (unsigned *)(sq_ring + params.sq_off.tail);
+  loop->sq_mask = *(unsigned *)(sq_ring + params.sq_off.ring_mask);
+  loop->sq_entries = params.sq_entries;
+  loop->sq_local_tail = *loop->sq_tail;
+  loop->sq_submitted = loop->sq_local_tail;
+  unsigned *sq_array = (unsigned *)(sq_ring + params.sq_off.array);
+  for (unsigned i = 0; i < params.sq_entries; i++) {
+    sq_array[i] = i;
   }
+  loop->cq_head = (unsigned *)(cq_ring + params.cq_off.head);
+  loop->cq_tail = (unsigned *)(cq_ring + params.cq_off.tail);
+  loop->cq_mask = *(unsigned *)(cq_ring + params.cq_off.ring_mask);
+  loop->cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
 
+  // Provided buffer ring: page-aligned, num_buffers entries, all filled
+  buf_ring_size = loop->num_buffers * sizeof(struct io_uring_buf);
+  loop->buf_ring = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  loop->buffers = malloc(loop->num_buffers * loop->buf_size);
+  if (loop->buf_ring == MAP_FAILED || loop->buffers == NULL) {
+    handle_error("buffer ring");
+  }
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)loop->buf_ring;
+  reg.ring_entries = loop->num_buffers;
+  reg.bgid = RING_BUFFER_GROUP;
+  if (syscall(__NR_io_uring_register, loop->ring_fd, IORING_REGISTER_PBUF_RING,
+              &reg, 1) == -1) {
+    int saved = errno;
+    close(loop->ring_fd);
+    errno = saved;
+    return -1;
+  }
+  for (unsigned bid = 0; bid < loop->num_buffers; bid++) {
+    recycle_buffer(loop, bid);
+  }
+  publish_buffers(loop);
+  loop->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  loop->retry_after.tv_nsec = ACCEPT_RETRY_NS;
   return 0;
 }
 
+// Publish the prepared SQEs and, if wait_for is set, sleep until that many
+// completions are ready: one io_uring_enter for the whole batch
+void submit_uring(struct uring_loop *loop, unsigned wait_for) {
+  __atomic_store_n(loop->sq_tail, loop->sq_local_tail, __ATOMIC_RELEASE);
+  for (;;) {
+    unsigned to_submit = loop->sq_local_tail - loop->sq_submitted;
+    long ret = syscall(__NR_io_uring_enter, loop->ring_fd, to_submit, wait_for,
+                       wait_for ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    count_syscall();
+    if (ret >= 0) {
+      loop->sq_submitted += (unsigned)ret;
+      return;
+    }
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      handle_error("io_uring_enter");
+    }
+  }
+}
+
+struct io_uring_sqe *get_sqe(struct uring_loop *loop) {
+  // A full submission queue is flushed to the kernel first
+  if (loop->sq_local_tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE) ==
+      loop->sq_entries) {
+    submit_uring(loop, 0);
+  }
+  struct io_uring_sqe *sqe =
+      &loop->sqes[loop->sq_local_tail++ & loop->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+// One accept SQE keeps producing a completion per new connection
+void arm_accept(struct uring_loop *loop) {
+  struct io_uring_sqe *sqe = get_sqe(loop);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = loop->sfd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = URING_ACCEPT;
+}
+
+// One recv SQE keeps producing a completion per chunk received, each in a
+// buffer the kernel picks from the buffer ring
+void arm_recv(struct uring_loop *loop, struct connection *conn) {
+  struct io_uring_sqe *sqe = get_sqe(loop);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->cfd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = RING_BUFFER_GROUP;
+  sqe->user_data = (uint64_t)(uintptr_t)conn;
+}
+
+// Out of descriptors: accept one connection into the spare descriptor's
+// slot and drop it, as the epoll loop does
+void arm_shed_accept(struct uring_loop *loop) {
+  struct io_uring_sqe *sqe = get_sqe(loop);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = loop->sfd;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = URING_SHED_ACCEPT;
+}
+
+// Re-arm accept only after ACCEPT_RETRY_NS, so a lasting error cannot spin
+void arm_accept_retry(struct uring_loop *loop) {
+  struct io_uring_sqe *sqe = get_sqe(loop);
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (uint64_t)(uintptr_t)&loop->retry_after;
+  sqe->len = 1;
+  sqe->user_data = URING_ACCEPT_RETRY;
+}
+
+// Multishot recv needs Linux 6.0, newer than anything else this mode uses,
+// and older kernels only reject it once a connection is served. Try one on
+// a socketpair first: it should complete with the byte sent, then with end
+// of file. Returns -1 with errno set if the kernel refuses it.
+int probe_multishot_recv(struct uring_loop *loop) {
+  struct connection probe;
+  int sv[2];
+  int res;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+    return -1;
+  }
+  memset(&probe, 0, sizeof(probe));
+  probe.cfd = sv[0];
+  arm_recv(loop, &probe);
+  if (write(sv[1], "x", 1) != 1) {
+    handle_error("write");
+  }
+  close(sv[1]);
+  for (;;) {
+    submit_uring(loop, 1);
+    unsigned head = *loop->cq_head;
+    struct io_uring_cqe *cqe = &loop->cqes[head & loop->cq_mask];
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    res = cqe->res;
+    if (res > 0) {
+      recycle_buffer(loop, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    __atomic_store_n(loop->cq_head, head + 1, __ATOMIC_RELEASE);
+    if (!more) {
+      break;
+    }
+  }
+  publish_buffers(loop);
+  close(sv[0]);
+  if (res < 0) {
+    errno = -res;
+    return -1;
+  }
+  return 0;
+}
+
+// Framed io_uring recv: frames wholly inside the provided buffer are parsed
+// in place, and only an unfinished one is copied out to wait for the rest.
+// On a bad frame the socket is shut down, which ends the multishot recv.
+void receive_frames(struct connection *conn, const char *data, size_t len) {
+  struct frame_buffer *fb = &conn->frames;
+  ssize_t used = 0;
+
+  if (fb->len == 0) {
+    used = parse_frames(&conn->stats, data, len);
+    if (used >= 0 && (size_t)used < len) {
+      memcpy(frame_space(fb), data + used, len - used);
+      fb->len = len - used;
+    }
+  } else {
+    memcpy(frame_space(fb), data, len);
+    fb->len += len;
+    used = consume_frames(&conn->stats, fb);
+  }
+  if (used == -1) {
+    conn->failed = 1;
+    free_frames(fb);
+    shutdown(conn->cfd, SHUT_RDWR);
+  }
+}
+
+void handle_completion(struct uring_loop *loop, struct io_uring_cqe *cqe) {
+  int more = cqe->flags & IORING_CQE_F_MORE;
+
+  if (cqe->user_data == URING_ACCEPT) {
+    // New connection
+    int transient = cqe->res == -EINTR || cqe->res == -ECONNABORTED;
+    if (cqe->res >= 0) {
+      struct connection *conn = calloc(1, sizeof(struct connection));
+      conn->cfd = cqe->res;
+      client_opened(&conn->stats);
+      arm_recv(loop, conn);
+    } else if (!transient) {
+      fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+    }
+    if (more) {
+      return;
+    }
+    // An error ends the multishot accept. The pending connection that hit
+    // it stays queued, so re-arming at once would fail the same way.
+    if ((cqe->res == -EMFILE || cqe->res == -ENFILE) && loop->spare_fd != -1) {
+      close(loop->spare_fd);
+      loop->spare_fd = -1;
+      arm_shed_accept(loop);
+    } else if (cqe->res < 0 && !transient) {
+      arm_accept_retry(loop);
+    } else {
+      arm_accept(loop);
+    }
+    return;
+  }
+  if (cqe->user_data == URING_SHED_ACCEPT) {
+    if (cqe->res >= 0) {
+      close(cqe->res);
+    }
+    loop->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    arm_accept(loop);
+    return;
+  }
+  if (cqe->user_data == URING_ACCEPT_RETRY) {
+    arm_accept(loop);
+    return;
+  }
+
+  // Received data: one completion is one message, like one read(), unless
+  // framed
+  struct connection *conn = (struct connection *)(uintptr_t)cqe->user_data;
+  if (cqe->res > 0) {
+    int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    char *data = loop->buffers + (size_t)bid * loop->buf_size;
+    if (framing == FRAMING_RAW) {
+      record_message(&conn->stats, data, cqe->res);
+    } else if (!conn->failed) {
+      receive_frames(conn, data, cqe->res);
+    }
+    recycle_buffer(loop, bid);
+  }
+  if (!more) {
+    // The multishot recv ended: re-arm after running out of buffers or a
+    // spurious stop, close on end of file or error
+    if (cqe->res > 0 || cqe->res == -ENOBUFS) {
+      arm_recv(loop, conn);
+    } else {
+      close_connection(conn);
+    }
+  }
+}
+
+void *uring_loop_thread(void *arg) {
+  struct uring_loop *loop = (struct uring_loop *)arg;
+
+  arm_accept(loop);
+  for (;;) {
+    // Submit everything queued and wait, in one system call, then work
+    // through every completion that is ready
+    submit_uring(loop, 1);
+    unsigned head = *loop->cq_head;
+    unsigned tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      handle_completion(loop, &loop->cqes[head & loop->cq_mask]);
+      head++;
+    }
+    __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+    publish_buffers(loop);
+  }
+  return NULL;
+}
+
+// io_uring mode: num_loops threads, each with its own ring and a multishot
+// accept on the shared listening socket. Returns NULL, with errno set and
+// nothing started, if this kernel cannot run it.
+void close_uring(struct uring_loop *loop) {
+  close(loop->ring_fd);
+  if (loop->spare_fd != -1) {
+    close(loop->spare_fd);
+  }
+}
+
+struct uring_loop *start_uring_loops(int sfd, int num_loops) {
+  struct uring_loop *loops = calloc(num_loops, sizeof(struct uring_loop));
+
+  for (int i = 0; i < num_loops; i++) {
+    int ok = setup_uring(&loops[i], sfd) == 0;
+    if (ok && i == 0 && probe_multishot_recv(&loops[0]) == -1) {
+      int saved = errno;
+      close_uring(&loops[0]);
+      errno = saved;
+      ok = 0;
+    }
+    if (!ok) {
+      int saved = errno;
+      for (int j = 0; j < i; j++) {
+        close_uring(&loops[j]);
+      }
+      free(loops);
+      errno = saved;
+      return NULL;
+    }
+  }
+  for (int i = 0; i < num_loops; i++) {
+    pthread_create(&loops[i].thread, NULL, uring_loop_thread, &loops[i]);
+  }
+  return loops;
+}
+
+// Serve sfd from background threads in the given mode. io_uring falls
+// back to epoll when the kernel cannot run it. Returns the mode started.
+int start_server(int mode, int sfd, int num_loops) {
+  pthread_t thread_id;
+
+  if (mode == MODE_URING && start_uring_loops(sfd, num_loops) == NULL) {
+    fprintf(stderr, "io_uring unavailable (%s), falling back to epoll\n",
+            strerror(errno));
+    mode = MODE_EPOLL;
+  }
+  if (mode == MODE_EPOLL) {
+    start_event_loops(sfd, num_loops);
+  } else if (mode == MODE_THREADS) {
+    pthread_create(&thread_id, NULL, accept_loop, (void *)(intptr_t)sfd);
+    pthread_detach(thread_id);
+  }
+  return mode;
+}
+
+
+// Runs the chosen server mode in this process on an ephemeral port, connects
+// num_clients clients that each send BENCH_MESSAGES messages (framed if the
+// server is), each with its own write(), and reports
+// how long the server took to receive everything. Server output goes to
+// stdout as usual (redirect it); the report goes to stderr.
+void run_bench(int mode, int num_loops, int num_clients) {
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  struct rlimit limit;
+  struct rusage usage;
+  struct timespec start;
+  int *cfds = malloc(num_clients * sizeof(int));
+  char msg[BUF_SIZE];
+  long expected = 0;
+  struct server_stats snap;
+  const char *mode_names[] = {"threads", "epoll", "io_uring"};
+  const char *framing_names[] = {"raw", "lines", "varint"};
+
+  // Each client costs two descriptors in this process
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  int sfd = open_listener(0);
+  if (getsockname(sfd, (struct sockaddr *)&addr, &addr_len) == -1) {
+    handle_error("getsockname");
+  }
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  mode = start_server(mode, sfd, num_loops);
+
+  for (int c = 0; c < num_clients; c++) {
+    cfds[c] = socket(AF_INET, SOCK_STREAM, 0);
+    if (cfds[c] == -1) {
+      handle_error("socket");
+    }
+    if (connect(cfds[c], (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+      handle_error("connect");
+    }
+  }
+  for (int m = 0; m < BENCH_MESSAGES; m++) {
+    for (int c = 0; c < num_clients; c++) {
+      int len = snprintf(msg + 1, sizeof(msg) - 1,
+                         "message %d from client %d\n", m, c);
+      char *out = msg + 1;
+      int out_len = len;
+      if (framing == FRAMING_VARINT) {
+        // Under 128 bytes, so the length prefix is a single byte
+        *--out = (char)len;
+        out_len++;
+      }
+      if (write(cfds[c], out, out_len) != out_len) {
+        handle_error("write");
+      }
+      expected += len;
+    }
+  }
+
+  do {
+    usleep(1000);
+    stats_snapshot(&snap, 0);
+  } while (snap.bytes < expected);
+
+  double seconds = seconds_since(&start);
+  getrusage(RUSAGE_SELF, &usage);
+  flush_log();
+  fprintf(stderr,
+          "mode,framing,loops,clients,bytes,messages,seconds,messages_per_s,"
+          "syscalls,syscalls_per_message,max_rss_kb\n"
+          "%s,%s,%d,%d,%ld,%ld,%.3f,%.0f,%ld,%.3f,%ld\n",
+          mode_names[mode], framing_names[framing],
+          mode == MODE_THREADS ? num_clients : num_loops,
+          num_clients, snap.bytes, snap.messages, seconds,
+          snap.messages / seconds, snap.syscalls,
+          (double)snap.syscalls / snap.messages, usage.ru_maxrss);
+  for (int c = 0; c < num_clients; c++) {
+    close(cfds[c]);
+  }
+  free(cfds);
+}
+
+int main(int argc, char *argv[]) {
+  int mode = MODE_THREADS;
+  int num_loops = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  int bench_clients = 0;
+  int stats_interval = 0;
+  int fd = STDOUT_FILENO;
+  pthread_t reporter;
+
+  // -e serves from epoll event loops and -u from io_uring rings, one per
+  // core unless -n says otherwise, instead of a thread per client; -B N
+  // benchmarks the chosen mode with N local clients; -S N reports stats
+  // every N seconds; -o FILE appends the output to FILE, not stdout; -f
+  // lines|varint splits what clients send into newline-terminated or
+  // varint length-prefixed messages instead of one per read
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-e") == 0) {
+      mode = MODE_EPOLL;
+    } else if (strcmp(argv[i], "-u") == 0) {
+      mode = MODE_URING;
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      num_loops = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+      bench_clients = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+      stats_interval = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      fd = open(argv[++i], O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+      if (fd == -1) {
+        handle_error(argv[i]);
+      }
+    } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc &&
+               strcmp(argv[i + 1], "lines") == 0) {
+      framing = FRAMING_LINES;
+      i++;
+    } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc &&
+               strcmp(argv[i + 1], "varint") == 0) {
+      framing = FRAMING_VARINT;
+      i++;
+    } else {
+      num_loops = 0;
+      break;
+    }
+  }
+  if (num_loops < 1 || bench_clients < 0 || stats_interval < 0) {
+    fprintf(stderr,
+            "Usage: %s [-e | -u] [-n event_loops] [-B clients] "
+            "[-S seconds] [-o output_file] [-f lines | -f varint]\n",
+            argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  start_log(fd);
+  if (stats_interval > 0) {
+    pthread_create(&reporter, NULL, stats_reporter,
+                   (void *)(intptr_t)stats_interval);
+    pthread_detach(reporter);
+  }
+  if (bench_clients > 0) {
+    run_bench(mode, num_loops, bench_clients);
+    return 0;
+  }
+
+  // The server threads keep running after main's
+  start_server(mode, open_listener(PORT), num_loops);
+  pthread_exit(NULL);
+}
+
 /*
 1. What is the address of the server it is trying to connect to (IP address and
 port number)? Answer: 127.0.0.1 (localhost) on port 8000